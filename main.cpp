@@ -1,14 +1,53 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
 namespace bedrock {
 	namespace {
 		using machine_word = std::uint16_t;
@@ -18,6 +57,14 @@ namespace bedrock {
 		constexpr auto block_words = block_size / word_size;
 		constexpr auto disk_size = block_size * (1 << 16);
 
+		// Sector numbers, which are wider than a machine word so that disks can hold more than 32 MiB
+		using block_index = std::uint32_t;
+		constexpr auto max_block_index = std::numeric_limits<block_index>::max();
+
+		using clock = std::chrono::steady_clock;
+		using block_buffer = std::array<machine_word, block_words>;
+		using block_bytes = std::array<std::uint8_t, block_size>;
+
 		enum class opcode : std::uint8_t {
 			jump,
 			read_high,
@@ -44,334 +91,5194 @@ namespace bedrock {
 			std::uint8_t source0;
 		};
 
-		struct disk_controller {
-			std::fstream file;
-			machine_word block_count;
-			machine_word block;
-			machine_word address;
+		[[noreturn]] void throw_system_error(const char* what)
+		{
+			throw std::system_error {errno, std::generic_category(), what};
+		}
+
+		class unique_fd {
+		public:
+			unique_fd() noexcept : fd {-1} {}
+			explicit unique_fd(int fd) noexcept : fd {fd} {}
+			unique_fd(unique_fd&& other) noexcept : fd {std::exchange(other.fd, -1)} {}
+			unique_fd(const unique_fd&) = delete;
+			~unique_fd() { reset(); }
 
-			disk_controller(const char* path) : file {}, block_count {}, block {}, address {}
+			unique_fd& operator=(unique_fd&& other) noexcept
 			{
-				if (path) {
-					file.exceptions(file.badbit | file.failbit);
-					file.open(path, file.binary | file.ate | file.in | file.out);
-					const auto n_blocks = file.tellg() / block_size;
-					block_count = n_blocks < max_word ? static_cast<machine_word>(n_blocks) : max_word;
-				}
+				reset(std::exchange(other.fd, -1));
+				return *this;
 			}
-		};
 
-		constexpr std::array<machine_word, 40> firmware_blob {
-			0x2001, 0xeb00, 0x2b28, 0x2108, 0x0201, 0x210a, 0x0211, 0xc000, 0xf0c0, 0x00bb,
-			0xe20c, 0x210a, 0x6021, 0x2110, 0x0001, 0x00bb, 0x203a, 0x8002, 0x2118, 0x0101,
-			0x2030, 0x6002, 0x211a, 0x0111, 0x2057, 0x6002, 0x9f4f, 0xcf0f, 0x2201, 0x5ee2,
-			0x2003, 0xb00e, 0x2126, 0x0101, 0x50bd, 0x40f0, 0x5d2d, 0xe00c, 0x210a, 0x0001};
+			unique_fd& operator=(const unique_fd&) = delete;
 
-		class memory_adapter {
-		public:
-			memory_adapter() : memory((1 << 16) - firmware_blob.size()) {}
+			int get() const noexcept { return fd; }
+			explicit operator bool() const noexcept { return fd >= 0; }
 
-			void write(machine_word address, machine_word word)
+			void reset(int new_fd = -1) noexcept
 			{
-				if (address >= firmware_blob.size())
-					memory[address - firmware_blob.size()] = word;
-			}
+				if (fd >= 0)
+					::close(fd);
 
-			auto read(machine_word address)
-			{
-				if (address >= firmware_blob.size())
-					return memory[address - firmware_blob.size()];
-				else
-					return firmware_blob[address];
+				fd = new_fd;
 			}
 
 		private:
-			std::vector<machine_word> memory;
+			int fd;
 		};
 
-		struct machine_state {
-			machine_word instruction_pointer;
-			machine_word high_word;
-			std::array<machine_word, 1 << 4> registers;
-			memory_adapter memory;
-			disk_controller disk0;
-			disk_controller disk1;
-			bool halt;
+		unique_fd open_file(const std::string& path, int flags, mode_t mode = 0)
+		{
+			unique_fd fd {::open(path.c_str(), flags | O_CLOEXEC, mode)};
+			if (!fd)
+				throw_system_error(path.c_str());
 
-			machine_state(const char* disk0_path, const char* disk1_path) :
-				instruction_pointer {},
-				high_word {},
-				registers {},
-				memory {},
-				disk0 {disk0_path},
-				disk1 {disk1_path},
-				halt {false}
-			{
+			return fd;
+		}
+
+		off_t file_size(int fd)
+		{
+			struct stat info {};
+			if (::fstat(fd, &info) < 0)
+				throw_system_error("fstat");
+
+			return info.st_size;
+		}
+
+		void read_fully(int fd, void* data, std::size_t size, off_t offset)
+		{
+			const auto bytes = static_cast<std::uint8_t*>(data);
+			for (std::size_t done {}; done < size;) {
+				const auto result = ::pread(fd, bytes + done, size - done, offset + done);
+				if (result < 0 && errno != EINTR)
+					throw_system_error("pread");
+				else if (result == 0)
+					throw std::runtime_error {"unexpected end of file"};
+				else if (result > 0)
+					done += result;
 			}
-		};
+		}
 
-		enum class disk_operation { read_block, write_block };
+		void write_fully(int fd, const void* data, std::size_t size, off_t offset)
+		{
+			const auto bytes = static_cast<const std::uint8_t*>(data);
+			for (std::size_t done {}; done < size;) {
+				const auto result = ::pwrite(fd, bytes + done, size - done, offset + done);
+				if (result < 0 && errno != EINTR)
+					throw_system_error("pwrite");
+				else if (result > 0)
+					done += result;
+			}
+		}
 
-		void do_disk_operation(disk_controller& disk, memory_adapter& memory, machine_word control)
+		void write_vector_fully(int fd, std::vector<iovec>& buffers, off_t offset)
 		{
-			if (!disk.file.is_open())
-				return;
+			auto next = buffers.data();
+			auto remaining = buffers.size();
+			while (remaining) {
+				const auto batch = static_cast<int>(std::min<std::size_t>(remaining, IOV_MAX));
+				const auto result = ::pwritev(fd, next, batch, offset);
+				if (result < 0 && errno != EINTR)
+					throw_system_error("pwritev");
+				else if (result < 0)
+					continue;
 
-			switch (static_cast<disk_operation>(control)) {
-			case disk_operation::read_block:
-				if (disk.block < disk.block_count) {
-					disk.file.seekg(block_size * disk.block);
-					for (auto i = 0u; i < block_words; ++i)
-						memory.write(disk.address + i, disk.file.get() << 8 | disk.file.get());
+				offset += result;
+				for (auto done = static_cast<std::size_t>(result); done;) {
+					if (done >= next->iov_len) {
+						done -= next->iov_len;
+						++next;
+						--remaining;
+					}
+					else {
+						next->iov_base = static_cast<std::uint8_t*>(next->iov_base) + done;
+						next->iov_len -= done;
+						done = 0;
+					}
 				}
+			}
+		}
 
-				break;
+		class unique_mapping {
+		public:
+			unique_mapping() noexcept : address {}, length {} {}
 
-			case disk_operation::write_block:
-				if (disk.block < disk.block_count) {
-					disk.file.seekg(block_size * disk.block);
-					for (auto i = 0u; i < block_size; ++i) {
-						const auto word = memory.read(disk.address + i);
-						disk.file.put(word >> 8);
-						disk.file.put(word & 0xff);
-					}
+			unique_mapping(int fd, std::size_t length, int protection, int flags, off_t offset = 0) :
+				address {::mmap(nullptr, length, protection, flags, fd, offset)},
+				length {length}
+			{
+				if (address == MAP_FAILED) {
+					address = nullptr;
+					throw_system_error("mmap");
 				}
+			}
 
-				break;
+			unique_mapping(unique_mapping&& other) noexcept :
+				address {std::exchange(other.address, nullptr)},
+				length {std::exchange(other.length, 0)}
+			{
+			}
 
-			default:
-				break;
+			unique_mapping(const unique_mapping&) = delete;
+			~unique_mapping() { reset(); }
+
+			unique_mapping& operator=(unique_mapping&& other) noexcept
+			{
+				reset();
+				address = std::exchange(other.address, nullptr);
+				length = std::exchange(other.length, 0);
+				return *this;
 			}
-		}
 
-		instruction_word decode(machine_word word) noexcept
+			unique_mapping& operator=(const unique_mapping&) = delete;
+
+			void* get() const noexcept { return address; }
+			std::size_t size() const noexcept { return length; }
+
+			// The mapping may move
+			void resize(std::size_t new_length)
+			{
+				const auto moved = ::mremap(address, length, new_length, MREMAP_MAYMOVE);
+				if (moved == MAP_FAILED)
+					throw_system_error("mremap");
+
+				address = moved;
+				length = new_length;
+			}
+
+			void reset() noexcept
+			{
+				if (address)
+					::munmap(address, length);
+
+				address = nullptr;
+				length = 0;
+			}
+
+		private:
+			void* address;
+			std::size_t length;
+		};
+
+		sockaddr_un unix_address(const std::string& path)
 		{
-			const auto op = (word & 0xf000) >> 12;
-			const auto destination = (word & 0x0f00) >> 8;
-			const auto source1 = (word & 0x00f0) >> 4;
-			const auto source0 = word & 0x000f;
-			return {
-				static_cast<opcode>(op),
-				static_cast<std::uint8_t>(destination),
-				static_cast<std::uint8_t>(source1),
-				static_cast<std::uint8_t>(source0)};
+			sockaddr_un address {};
+			address.sun_family = AF_UNIX;
+			if (path.size() >= sizeof(address.sun_path))
+				throw std::runtime_error {"socket path too long"};
+
+			std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+			return address;
 		}
 
-		void do_bus_read(machine_state& state, const instruction_word& instruction)
+		unique_fd connect_unix(const std::string& path)
 		{
-			const auto port = state.registers[instruction.source0];
-			switch (port) {
-			case 0x0000:
-				state.registers[instruction.destination] = std::cin.get() & 0xff;
-				break;
+			const auto address = unix_address(path);
+			unique_fd fd {::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+			if (!fd)
+				throw_system_error("socket");
 
-			case 0x0001:
-				state.registers[instruction.destination] = state.disk0.block_count;
-				break;
+			if (::connect(fd.get(), reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0)
+				throw_system_error(path.c_str());
 
-			case 0x0002:
-				state.registers[instruction.destination] = state.disk0.block;
-				break;
+			return fd;
+		}
 
-			case 0x0003:
-				state.registers[instruction.destination] = state.disk0.address;
-				break;
+		// Replaces any stale socket left at the path
+		unique_fd listen_unix(const std::string& path)
+		{
+			const auto address = unix_address(path);
+			unique_fd fd {::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+			if (!fd)
+				throw_system_error("socket");
 
-			case 0x0004:
-				state.registers[instruction.destination] = state.disk1.block_count;
-				break;
+			::unlink(path.c_str());
+			if (::bind(fd.get(), reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0)
+				throw_system_error(path.c_str());
 
-			case 0x0005:
-				state.registers[instruction.destination] = state.disk1.block;
-				break;
+			if (::listen(fd.get(), SOMAXCONN) < 0)
+				throw_system_error("listen");
 
-			case 0x0006:
-				state.registers[instruction.destination] = state.disk1.address;
-				break;
+			return fd;
+		}
 
-			default:
-				state.registers[instruction.destination] = 0;
-				break;
+		void send_fully(int fd, const void* data, std::size_t size)
+		{
+			const auto bytes = static_cast<const std::uint8_t*>(data);
+			for (std::size_t done {}; done < size;) {
+				const auto result = ::send(fd, bytes + done, size - done, MSG_NOSIGNAL);
+				if (result < 0 && errno != EINTR)
+					throw_system_error("send");
+				else if (result > 0)
+					done += result;
 			}
 		}
 
-		void do_bus_write(machine_state& state, const instruction_word& instruction)
+		// Returns false if the peer closed the connection before sending anything
+		bool receive_fully(int fd, void* data, std::size_t size)
 		{
-			const auto port = state.registers[instruction.source0];
-			const auto word = state.registers[instruction.source1];
-			switch (port) {
-			case 0x0000:
-				std::cout.put(word & 0xff);
-				break;
+			const auto bytes = static_cast<std::uint8_t*>(data);
+			for (std::size_t done {}; done < size;) {
+				const auto result = ::recv(fd, bytes + done, size - done, 0);
+				if (result < 0 && errno != EINTR)
+					throw_system_error("recv");
+				else if (result == 0 && done == 0)
+					return false;
+				else if (result == 0)
+					throw std::runtime_error {"connection closed mid-message"};
+				else if (result > 0)
+					done += result;
+			}
 
-			case 0x0001:
-				do_disk_operation(state.disk0, state.memory, word);
-				break;
+			return true;
+		}
 
-			case 0x0002:
-				state.disk0.block = word;
-				break;
+		// Passes a job's serial input and output, in that order, along with a single byte
+		void send_descriptors(int fd, const std::array<int, 2>& descriptors)
+		{
+			char byte {};
+			iovec data {&byte, 1};
+			alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(descriptors))> control {};
+			msghdr message {};
+			message.msg_iov = &data;
+			message.msg_iovlen = 1;
+			message.msg_control = control.data();
+			message.msg_controllen = control.size();
+			const auto header = CMSG_FIRSTHDR(&message);
+			header->cmsg_level = SOL_SOCKET;
+			header->cmsg_type = SCM_RIGHTS;
+			header->cmsg_len = CMSG_LEN(sizeof(descriptors));
+			std::memcpy(CMSG_DATA(header), descriptors.data(), sizeof(descriptors));
+			while (::sendmsg(fd, &message, MSG_NOSIGNAL) < 0)
+				if (errno != EINTR)
+					throw_system_error("sendmsg");
+		}
 
-			case 0x0003:
-				state.disk0.address = word;
-				break;
+		// Returns nothing if the peer sent anything but two descriptors
+		std::optional<std::array<unique_fd, 2>> receive_descriptors(int fd)
+		{
+			char byte {};
+			iovec data {&byte, 1};
+			alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int[2]))> control {};
+			msghdr message {};
+			message.msg_iov = &data;
+			message.msg_iovlen = 1;
+			message.msg_control = control.data();
+			message.msg_controllen = control.size();
+			auto result = ::recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+			while (result < 0 && errno == EINTR)
+				result = ::recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
 
-			case 0x0004:
-				do_disk_operation(state.disk1, state.memory, word);
-				break;
+			if (result < 0)
+				throw_system_error("recvmsg");
 
-			case 0x0005:
-				state.disk1.block = word;
-				break;
+			const auto header = CMSG_FIRSTHDR(&message);
+			if (!header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+				return {};
 
-			case 0x0006:
-				state.disk1.address = word;
-				break;
+			const auto count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			std::array<int, 2> received {-1, -1};
+			std::memcpy(received.data(), CMSG_DATA(header), std::min(count, received.size()) * sizeof(int));
+			std::array<unique_fd, 2> descriptors {unique_fd {received[0]}, unique_fd {received[1]}};
+			if (count != received.size() || (message.msg_flags & MSG_CTRUNC))
+				return {};
 
-			case 0x0007:
-				state.halt = word;
-				break;
+			return descriptors;
+		}
 
-			default:
-				break;
+		// Disk images store each word big-endian, high byte first.
+		void unpack_words(const std::uint8_t* bytes, std::size_t count, machine_word* words) noexcept
+		{
+			for (std::size_t i {}; i < count; ++i)
+				words[i] = bytes[2 * i] << 8 | bytes[2 * i + 1];
+		}
+
+		void pack_words(const machine_word* words, std::size_t count, std::uint8_t* bytes) noexcept
+		{
+			for (std::size_t i {}; i < count; ++i) {
+				bytes[2 * i] = words[i] >> 8;
+				bytes[2 * i + 1] = words[i] & 0xff;
 			}
 		}
 
-		void execute(machine_state& state)
+		std::uint32_t fnv1a(const void* data, std::size_t size, std::uint32_t hash = 0x811c9dc5) noexcept
 		{
-			while (!state.halt) {
-				const auto instruction = decode(state.memory.read(state.instruction_pointer++));
-				switch (instruction.op) {
-				case opcode::jump:
-					if (state.registers[instruction.source1]) {
-						const auto link = state.instruction_pointer;
-						state.instruction_pointer = state.registers[instruction.source0];
-						state.registers[instruction.destination] = link;
-					}
+			const auto bytes = static_cast<const std::uint8_t*>(data);
+			for (std::size_t i {}; i < size; ++i)
+				hash = (hash ^ bytes[i]) * 0x01000193;
 
-					break;
+			return hash;
+		}
 
-				case opcode::read_high:
-					state.registers[instruction.destination] = state.high_word;
-					break;
+		class disk_backend {
+		public:
+			virtual ~disk_backend() = default;
 
-				case opcode::set:
-					state.registers[instruction.destination] = instruction.source1 << 4 | instruction.source0;
-					break;
+			virtual block_index block_count() const noexcept = 0;
 
-				case opcode::load:
-					state.registers[instruction.destination] = state.memory.read(state.registers[instruction.source0]);
-					break;
+			// Both transfer `count` consecutive sectors, `count * block_words` words at `words`
+			virtual void read(block_index first, std::size_t count, machine_word* words) = 0;
+			virtual void write(block_index first, std::size_t count, const machine_word* words) = 0;
 
-				case opcode::store:
-					state.memory.write(state.registers[instruction.source0], state.registers[instruction.source1]);
-					break;
+			// Words for `count` consecutive sectors, as one piece of a scatter-gather transfer
+			struct segment {
+				machine_word* words;
+				std::size_t count;
+			};
 
-				case opcode::add: {
-					const std::uint32_t a {state.registers[instruction.source0]};
-					const std::uint32_t b {state.registers[instruction.source1]};
-					const auto c = a + b;
-					state.registers[instruction.destination] = c & 0xffff;
-					state.high_word = c >> 16;
-					break;
+			// Scatter-gather forms of read() and write(): the sectors starting at `first` are spread over `segments` in
+			// order. Backends that can should move the whole run in a single host operation.
+			virtual void read_segments(block_index first, const std::vector<segment>& segments)
+			{
+				for (const auto& [words, count] : segments) {
+					read(first, count, words);
+					first += count;
 				}
+			}
 
-				case opcode::subtract: {
-					const std::uint32_t a {state.registers[instruction.source0]};
-					const std::uint32_t b {state.registers[instruction.source1]};
-					const auto c = a - b;
-					state.registers[instruction.destination] = c & 0xffff;
-					state.high_word = c >> 16;
-					break;
+			virtual void write_segments(block_index first, const std::vector<segment>& segments)
+			{
+				for (const auto& [words, count] : segments) {
+					write(first, count, words);
+					first += count;
 				}
+			}
 
-				case opcode::multiply: {
-					const std::uint32_t a {state.registers[instruction.source0]};
-					const std::uint32_t b {state.registers[instruction.source1]};
-					const auto c = a * b;
-					state.registers[instruction.destination] = c & 0xffff;
-					state.high_word = c >> 16;
-					break;
+			// Called periodically while the machine runs, for any time-driven housekeeping
+			virtual void poll(clock::time_point) {}
+
+			// Hands every completed write to the host; called at halt
+			virtual void flush() {}
+
+			// Blocks until every flushed write is durable
+			virtual void sync() {}
+
+			// Internal snapshots, for backends that keep them. snapshot() returns the new snapshot's ID; ID 0 always names
+			// the disk as it was before any writes. revert() returns false if there is no such snapshot.
+			virtual std::optional<machine_word> snapshot() { return {}; }
+			virtual bool revert(machine_word) { return false; }
+
+		protected:
+			static std::size_t total_blocks(const std::vector<segment>& segments) noexcept
+			{
+				std::size_t total {};
+				for (const auto& segment : segments)
+					total += segment.count;
+
+				return total;
+			}
+		};
+
+		// With a nonzero `queue_limit`, writes are held back in a queue sorted by sector and submitted once it fills up,
+		// whenever the machine is polled, and at halt; each run of adjacent sectors in the queue goes out as one pwritev.
+		// Reads of queued sectors are served from the queue.
+		class image_file final : public disk_backend {
+		public:
+			image_file(const std::string& path, bool writable = true, std::size_t queue_limit = 0) :
+				fd {open_file(path, writable ? O_RDWR : O_RDONLY)},
+				size {},
+				bytes {},
+				queue_limit {queue_limit},
+				queued {}
+			{
+				const auto n_blocks = file_size(fd.get()) / block_size;
+				size = n_blocks < max_block_index ? static_cast<block_index>(n_blocks) : max_block_index;
+			}
+
+			block_index block_count() const noexcept override { return size; }
+
+			void read(block_index first, std::size_t count, machine_word* words) override
+			{
+				bytes.resize(count * block_size);
+				read_fully(fd.get(), bytes.data(), bytes.size(), off_t {block_size} * first);
+				apply_queued(first, count, bytes.data());
+				unpack_words(bytes.data(), count * block_words, words);
+			}
+
+			void write(block_index first, std::size_t count, const machine_word* words) override
+			{
+				if (queue_limit) {
+					for (std::size_t i {}; i < count; ++i)
+						pack_words(words + i * block_words, block_words, queued[first + i].data());
+
+					if (queued.size() >= queue_limit)
+						submit();
+
+					return;
 				}
 
-				case opcode::divide: {
-					const std::uint32_t a {state.registers[instruction.source0]};
-					const std::uint32_t b {state.registers[instruction.source1]};
-					const std::uint32_t c {b ? a / b : 0xffffffff};
-					state.registers[instruction.destination] = c & 0xffff;
-					state.high_word = c >> 16;
-					break;
+				bytes.resize(count * block_size);
+				pack_words(words, count * block_words, bytes.data());
+				write_fully(fd.get(), bytes.data(), bytes.size(), off_t {block_size} * first);
+			}
+
+			// Since every word is byte-swapped through a staging buffer anyway, a run of sectors is one pread or pwrite
+			// of a single contiguous buffer, no matter how many segments it is scattered over
+			void read_segments(block_index first, const std::vector<segment>& segments) override
+			{
+				const auto count = total_blocks(segments);
+				bytes.resize(count * block_size);
+				read_fully(fd.get(), bytes.data(), bytes.size(), off_t {block_size} * first);
+				apply_queued(first, count, bytes.data());
+				auto source = bytes.data();
+				for (const auto& [words, count] : segments) {
+					unpack_words(source, count * block_words, words);
+					source += count * block_size;
+				}
+			}
+
+			void write_segments(block_index first, const std::vector<segment>& segments) override
+			{
+				if (queue_limit) {
+					disk_backend::write_segments(first, segments);
+					return;
 				}
 
-				case opcode::shift_left:
-					state.registers[instruction.destination] = state.registers[instruction.source0]
-						<< instruction.source1;
+				bytes.resize(total_blocks(segments) * block_size);
+				auto destination = bytes.data();
+				for (const auto& [words, count] : segments) {
+					pack_words(words, count * block_words, destination);
+					destination += count * block_size;
+				}
 
-					break;
+				write_fully(fd.get(), bytes.data(), bytes.size(), off_t {block_size} * first);
+			}
 
-				case opcode::shift_right:
-					state.registers[instruction.destination]
-						= state.registers[instruction.source0] >> instruction.source1;
+			void poll(clock::time_point) override { submit(); }
+			void flush() override { submit(); }
 
-					break;
+			void sync() override
+			{
+				submit();
+				if (::fsync(fd.get()) < 0)
+					throw_system_error("fsync");
+			}
 
-				case opcode::logic_and:
-					state.registers[instruction.destination]
-						= state.registers[instruction.source0] & state.registers[instruction.source1];
+		private:
+			unique_fd fd;
+			block_index size;
+			std::vector<std::uint8_t> bytes;
+			std::size_t queue_limit;
+			std::map<block_index, block_bytes> queued;
 
-					break;
+			void apply_queued(block_index first, std::size_t count, std::uint8_t* destination) const
+			{
+				const auto last = queued.lower_bound(static_cast<block_index>(first + count));
+				for (auto found = queued.lower_bound(first); found != last; ++found) {
+					const auto& [block, data] = *found;
+					std::memcpy(destination + (block - first) * block_size, data.data(), data.size());
+				}
+			}
+
+			void submit()
+			{
+				std::vector<iovec> run {};
+				auto run_start = queued.begin();
+				for (auto found = queued.begin(); found != queued.end(); ++found) {
+					if (found != run_start && found->first != std::prev(found)->first + 1) {
+						write_vector_fully(fd.get(), run, off_t {block_size} * run_start->first);
+						run.clear();
+						run_start = found;
+					}
 
-				case opcode::logic_or:
-					state.registers[instruction.destination]
-						= state.registers[instruction.source0] | state.registers[instruction.source1];
+					run.push_back({found->second.data(), found->second.size()});
+				}
 
-					break;
+				if (!run.empty())
+					write_vector_fully(fd.get(), run, off_t {block_size} * run_start->first);
 
-				case opcode::logic_not:
-					state.registers[instruction.destination] = ~state.registers[instruction.source0];
-					break;
+				queued.clear();
+			}
+		};
 
-				case opcode::bus_read:
-					do_bus_read(state, instruction);
-					break;
+		struct journal_options {
+			bool enabled {};
+			unsigned batch_size {64};
+			std::chrono::milliseconds interval {100};
+		};
 
-				case opcode::bus_write:
-					do_bus_write(state, instruction);
-					break;
+		// Sector writes are appended to a write-ahead journal beside the image and made durable a batch at a time, once
+		// every `batch_size` writes or `interval` after the first uncommitted write, whichever comes first. Committed
+		// sectors are checkpointed into the image once the journal grows large, and at halt. A commit record closes each
+		// batch, so after a crash the next open replays whole committed batches into the image and discards the rest;
+		// the image never sees a torn sector.
+		class journaled_disk final : public disk_backend {
+		public:
+			journaled_disk(std::unique_ptr<disk_backend> disk, const std::string& path, const journal_options& options) :
+				image {std::move(disk)},
+				journal {open_file(path, O_RDWR | O_CREAT, 0644)},
+				options {options},
+				journal_size {},
+				pending {},
+				batch {},
+				batched {},
+				batch_start {}
+			{
+				recover();
+			}
+
+			block_index block_count() const noexcept override { return image->block_count(); }
+
+			void read(block_index first, std::size_t count, machine_word* words) override
+			{
+				image->read(first, count, words);
+				const auto last = pending.lower_bound(static_cast<block_index>(first + count));
+				for (auto found = pending.lower_bound(first); found != last; ++found) {
+					const auto& [block, contents] = *found;
+					std::copy(contents.begin(), contents.end(), words + (block - first) * block_words);
 				}
 			}
-		}
-	}
-}
 
-using namespace bedrock;
+			void write(block_index first, std::size_t count, const machine_word* words) override
+			{
+				for (std::size_t i {}; i < count; ++i, words += block_words) {
+					if (!batched)
+						batch_start = clock::now();
 
-int main(int argc, char** argv)
-{
-	if (argc != 3) {
-		std::cout << "Usage: bedrock <disk0> <disk1>\n";
-		std::cout << "Use -- to omit a disk file.\n";
-		return 0;
-	}
+					const std::uint32_t block = first + i;
+					record_header header {data_magic, block, 0};
+					block_bytes bytes {};
+					pack_words(words, block_words, bytes.data());
+					header.checksum = fnv1a(bytes.data(), bytes.size(), fnv1a(&block, sizeof(block)));
+					append(header);
+					batch.insert(batch.end(), bytes.begin(), bytes.end());
+					std::copy_n(words, block_words, pending[block].begin());
+					if (++batched >= options.batch_size)
+						commit();
+				}
+			}
 
-	const auto nullptr_if_none = [](auto path) { return std::strcmp(path, "--") == 0 ? nullptr : path; };
-	const auto check_path = [](auto path) {
-		if (!path || std::filesystem::exists(path))
-			return true;
+			void poll(clock::time_point now) override
+			{
+				if (batched && now - batch_start >= options.interval)
+					commit();
+			}
 
-		std::cerr << "File \"" << path << "\" does not exist.\n";
+			void flush() override
+			{
+				commit();
+				checkpoint();
+			}
 
-		return false;
-	};
+		private:
+			struct record_header {
+				std::uint32_t magic;
+				std::uint32_t block;
+				std::uint32_t checksum;
+			};
 
-	const auto disk0 = nullptr_if_none(argv[1]);
-	const auto disk1 = nullptr_if_none(argv[2]);
-	if (!(check_path(disk0) && check_path(disk1)))
-		return 1;
+			static constexpr std::uint32_t data_magic {0x4244'4a44};
+			static constexpr std::uint32_t commit_magic {0x4244'4a43};
+			static constexpr off_t checkpoint_threshold {4 << 20};
 
-	try {
-		machine_state state {disk0, disk1};
-		execute(state);
+			std::unique_ptr<disk_backend> image;
+			unique_fd journal;
+			journal_options options;
+			off_t journal_size;
+			std::map<block_index, block_buffer> pending;
+			std::vector<std::uint8_t> batch;
+			unsigned batched;
+			clock::time_point batch_start;
+
+			void append(const record_header& header)
+			{
+				const auto bytes = reinterpret_cast<const std::uint8_t*>(&header);
+				batch.insert(batch.end(), bytes, bytes + sizeof(header));
+			}
+
+			void commit()
+			{
+				if (!batched)
+					return;
+
+				const std::uint32_t count {batched};
+				append({commit_magic, count, fnv1a(&count, sizeof(count))});
+				write_fully(journal.get(), batch.data(), batch.size(), journal_size);
+				if (::fdatasync(journal.get()) < 0)
+					throw_system_error("fdatasync");
+
+				journal_size += batch.size();
+				batch.clear();
+				batched = 0;
+				if (journal_size >= checkpoint_threshold)
+					checkpoint();
+			}
+
+			void checkpoint()
+			{
+				if (pending.empty())
+					return;
+
+				for (const auto& [block, words] : pending)
+					image->write(block, 1, words.data());
+
+				image->flush();
+				image->sync();
+				truncate();
+				pending.clear();
+			}
+
+			void truncate()
+			{
+				if (::ftruncate(journal.get(), 0) < 0)
+					throw_system_error("ftruncate");
+
+				if (::fsync(journal.get()) < 0)
+					throw_system_error("fsync");
+
+				journal_size = 0;
+			}
+
+			void recover()
+			{
+				std::vector<std::uint8_t> contents(file_size(journal.get()));
+				if (contents.empty())
+					return;
+
+				read_fully(journal.get(), contents.data(), contents.size(), 0);
+				std::map<block_index, block_buffer> staged {};
+				std::size_t offset {};
+				while (contents.size() - offset >= sizeof(record_header)) {
+					record_header header {};
+					std::memcpy(&header, contents.data() + offset, sizeof(header));
+					offset += sizeof(header);
+					if (header.magic == commit_magic) {
+						if (header.checksum != fnv1a(&header.block, sizeof(header.block)))
+							break;
+
+						for (auto& [block, words] : staged)
+							pending[block] = words;
+
+						staged.clear();
+					}
+					else if (header.magic == data_magic && contents.size() - offset >= block_size) {
+						const auto bytes = contents.data() + offset;
+						offset += block_size;
+						if (header.checksum != fnv1a(bytes, block_size, fnv1a(&header.block, sizeof(header.block)))
+							|| header.block >= image->block_count())
+							break;
+
+						unpack_words(bytes, block_words, staged[static_cast<block_index>(header.block)].data());
+					}
+					else {
+						break;
+					}
+				}
+
+				checkpoint();
+				truncate();
+			}
+		};
+
+		enum class write_back_policy { never, at_halt, periodic };
+
+		struct ramdisk_options {
+			bool enabled {};
+			write_back_policy policy {write_back_policy::at_halt};
+			std::chrono::milliseconds interval {};
+		};
+
+		// Holds the entire image in host memory as native-endian words, so sector commands are plain copies. Writes
+		// reach the image file only as the write-back policy allows: never, at halt, or every `interval` while the
+		// machine runs, in which case only sectors dirtied since the last write-back are written.
+		class ram_disk final : public disk_backend {
+		public:
+			ram_disk(const std::string& path, const ramdisk_options& options) :
+				file {open_file(path, options.policy == write_back_policy::never ? O_RDONLY : O_RDWR)},
+				options {options},
+				size {},
+				contents {},
+				dirty {},
+				last_write_back {clock::now()}
+			{
+				const auto n_blocks = file_size(file.get()) / block_size;
+				size = n_blocks < max_block_index ? static_cast<block_index>(n_blocks) : max_block_index;
+				contents.resize(std::size_t {size} * block_words);
+				dirty.resize(size);
+				std::vector<std::uint8_t> chunk(std::size_t {block_size} * chunk_blocks);
+				for (std::size_t first {}; first < size; first += chunk_blocks) {
+					const auto count = std::min<std::size_t>(chunk_blocks, size - first);
+					read_fully(file.get(), chunk.data(), count * block_size, off_t {block_size} * first);
+					unpack_words(chunk.data(), count * block_words, contents.data() + first * block_words);
+				}
+			}
+
+			block_index block_count() const noexcept override { return size; }
+
+			void read(block_index first, std::size_t count, machine_word* words) override
+			{
+				std::memcpy(words, contents.data() + std::size_t {first} * block_words, count * block_size);
+			}
+
+			void write(block_index first, std::size_t count, const machine_word* words) override
+			{
+				std::memcpy(contents.data() + std::size_t {first} * block_words, words, count * block_size);
+				std::fill_n(dirty.begin() + first, count, true);
+			}
+
+			void poll(clock::time_point now) override
+			{
+				if (options.policy == write_back_policy::periodic && now - last_write_back >= options.interval) {
+					write_back();
+					last_write_back = now;
+				}
+			}
+
+			void flush() override
+			{
+				if (options.policy != write_back_policy::never)
+					write_back();
+			}
+
+			void sync() override
+			{
+				if (options.policy != write_back_policy::never && ::fsync(file.get()) < 0)
+					throw_system_error("fsync");
+			}
+
+		private:
+			unique_fd file;
+			ramdisk_options options;
+			block_index size;
+			std::vector<machine_word> contents;
+			std::vector<bool> dirty;
+			clock::time_point last_write_back;
+
+			static constexpr std::size_t chunk_blocks {256};
+
+			// Each run of consecutive dirty sectors, up to `chunk_blocks` long, goes out in one write
+			void write_back()
+			{
+				std::vector<std::uint8_t> chunk {};
+				for (std::size_t first {}; first < size;) {
+					if (!dirty[first]) {
+						++first;
+						continue;
+					}
+
+					auto last = first;
+					for (; last < size && dirty[last] && last - first < chunk_blocks; ++last)
+						dirty[last] = false;
+
+					chunk.resize((last - first) * block_size);
+					pack_words(contents.data() + first * block_words, (last - first) * block_words, chunk.data());
+					write_fully(file.get(), chunk.data(), chunk.size(), off_t {block_size} * first);
+					first = last;
+				}
+			}
+		};
+
+		// The most recently used sectors, up to a fixed number of them
+		class sector_cache {
+		public:
+			explicit sector_cache(std::size_t capacity) : capacity {capacity}, recent {}, index {} {}
+
+			bool contains(block_index block) const { return index.find(block) != index.end(); }
+
+			const machine_word* find(block_index block)
+			{
+				const auto found = index.find(block);
+				if (found == index.end())
+					return nullptr;
+
+				recent.splice(recent.begin(), recent, found->second);
+				return found->second->second.data();
+			}
+
+			void insert(block_index block, const machine_word* words)
+			{
+				if (!capacity)
+					return;
+
+				if (const auto found = index.find(block); found != index.end()) {
+					recent.splice(recent.begin(), recent, found->second);
+				}
+				else if (index.size() < capacity) {
+					recent.emplace_front(block, block_buffer {});
+					index.emplace(block, recent.begin());
+				}
+				else {
+					index.erase(recent.back().first);
+					recent.splice(recent.begin(), recent, std::prev(recent.end()));
+					recent.front().first = block;
+					index.emplace(block, recent.begin());
+				}
+
+				std::copy_n(words, block_words, recent.front().second.begin());
+			}
+
+		private:
+			std::size_t capacity;
+			std::list<std::pair<block_index, block_buffer>> recent;
+			std::unordered_map<block_index, decltype(recent)::iterator> index;
+		};
+
+		// Reads and writes the image with O_DIRECT, bypassing the host page cache so that many emulators on one host don't
+		// crowd each other (and everything else) out of it. The most recently used `cache_blocks` sectors are kept in a
+		// cache of the emulator's own instead. If the file system refuses direct I/O, the image goes through the page
+		// cache as usual, but with posix_fadvise() hints to drop each range from it once it has been transferred.
+		class direct_image final : public disk_backend {
+		public:
+			direct_image(const std::string& path, bool writable, std::size_t cache_blocks) :
+				fd {},
+				direct {true},
+				size {},
+				staging {},
+				staging_size {},
+				cache {cache_blocks}
+			{
+				const auto flags = writable ? O_RDWR : O_RDONLY;
+				fd.reset(::open(path.c_str(), flags | O_CLOEXEC | O_DIRECT));
+				const auto n_blocks = file_size(fd ? fd.get() : open_file(path, flags).get()) / block_size;
+				size = n_blocks < max_block_index ? static_cast<block_index>(n_blocks) : max_block_index;
+
+				// Some file systems accept O_DIRECT at open but then reject I/O in units smaller than their own blocks
+				if (fd && size && ::pread(fd.get(), stage(block_size), block_size, 0) < 0 && errno == EINVAL)
+					fd.reset();
+
+				if (!fd) {
+					fd = open_file(path, flags);
+					direct = false;
+					::posix_fadvise(fd.get(), 0, 0, POSIX_FADV_RANDOM);
+				}
+			}
+
+			block_index block_count() const noexcept override { return size; }
+
+			void read(block_index first, std::size_t count, machine_word* words) override
+			{
+				for (std::size_t i {}; i < count;) {
+					if (const auto found = cache.find(first + i)) {
+						std::copy_n(found, block_words, words + i * block_words);
+						++i;
+						continue;
+					}
+
+					auto end = i + 1;
+					while (end < count && !cache.contains(first + end))
+						++end;
+
+					const auto bytes = (end - i) * block_size;
+					const auto offset = off_t {block_size} * static_cast<off_t>(first + i);
+					read_fully(fd.get(), stage(bytes), bytes, offset);
+					advise(offset, bytes);
+					unpack_words(staging.get(), (end - i) * block_words, words + i * block_words);
+					for (; i < end; ++i)
+						cache.insert(first + i, words + i * block_words);
+				}
+			}
+
+			void write(block_index first, std::size_t count, const machine_word* words) override
+			{
+				const auto bytes = count * block_size;
+				const auto offset = off_t {block_size} * first;
+				pack_words(words, count * block_words, stage(bytes));
+				write_fully(fd.get(), staging.get(), bytes, offset);
+				advise(offset, bytes);
+				for (std::size_t i {}; i < count; ++i)
+					cache.insert(first + i, words + i * block_words);
+			}
+
+			void sync() override
+			{
+				if (::fsync(fd.get()) < 0)
+					throw_system_error("fsync");
+			}
+
+		private:
+			// Enough for the logical block size of any device O_DIRECT might sit on
+			static constexpr std::size_t alignment {4096};
+
+			struct free_deleter {
+				void operator()(std::uint8_t* data) const noexcept { std::free(data); }
+			};
+
+			unique_fd fd;
+			bool direct;
+			block_index size;
+			std::unique_ptr<std::uint8_t[], free_deleter> staging;
+			std::size_t staging_size;
+			sector_cache cache;
+
+			std::uint8_t* stage(std::size_t size)
+			{
+				if (size > staging_size) {
+					const auto rounded = (size + alignment - 1) / alignment * alignment;
+					staging.reset(static_cast<std::uint8_t*>(std::aligned_alloc(alignment, rounded)));
+					if (!staging)
+						throw std::bad_alloc {};
+
+					staging_size = rounded;
+				}
+
+				return staging.get();
+			}
+
+			void advise(off_t offset, std::size_t size) const noexcept
+			{
+				if (!direct)
+					::posix_fadvise(fd.get(), offset, size, POSIX_FADV_DONTNEED);
+			}
+		};
+
+		// The block protocol spoken over a Unix socket by remote_disk and serve_disks(). Both ends share a host, so fields
+		// are in host byte order, while sector data is exactly as stored in the image. A connection first opens one image
+		// by name, then may issue any number of requests without waiting; replies come back in order.
+		enum class block_request : std::uint32_t { open, read, write, sync };
+
+		struct block_request_header {
+			block_request operation;
+			std::uint32_t tag;
+			std::uint32_t first;
+
+			// Sectors of data, or for open, the length of the name that follows
+			std::uint32_t count;
+		};
+
+		struct block_reply_header {
+			std::uint32_t tag;
+
+			// An errno value, or zero on success
+			std::uint32_t error;
+
+			// For open, the number of sectors in the image
+			std::uint32_t size;
+
+			// Sectors of data that follow
+			std::uint32_t count;
+		};
+
+		constexpr std::uint32_t max_block_request {1 << 12};
+
+		// A disk held by a storage server on the same host. Writes are sent without waiting for them to be acknowledged,
+		// up to `window` requests in flight, and a local cache keeps recently used sectors. A read that continues where
+		// the last one left off also asks for the next `readahead` sectors, to be collected along with later replies.
+		class remote_disk final : public disk_backend {
+		public:
+			remote_disk(const std::string& socket_path, const std::string& name, std::size_t cache_blocks) :
+				connection {connect_unix(socket_path)},
+				size {},
+				next_tag {},
+				outstanding {},
+				unacknowledged {},
+				cache {cache_blocks},
+				bytes {},
+				next_block {},
+				prefetched_until {}
+			{
+				send_request(block_request::open, 0, static_cast<std::uint32_t>(name.size()), nullptr);
+				send_fully(connection.get(), name.data(), name.size());
+				const auto reply = receive_reply();
+				size = reply.size;
+			}
+
+			block_index block_count() const noexcept override { return size; }
+
+			void read(block_index first, std::size_t count, machine_word* words) override
+			{
+				const auto sequential = first == next_block;
+				next_block = first + count;
+				if (copy_cached(first, count, words))
+					return;
+
+				// Anything missing may already be on its way, so collect that first
+				drain();
+				if (copy_cached(first, count, words))
+					return;
+
+				for (std::size_t i {}; i < count;) {
+					if (cache.contains(first + i)) {
+						++i;
+						continue;
+					}
+
+					auto end = i + 1;
+					while (end < count && end - i < max_block_request && !cache.contains(first + end))
+						++end;
+
+					request_read(first + i, end - i, words + i * block_words);
+					i = end;
+				}
+
+				const auto waiting = outstanding.size();
+				if (sequential) {
+					const auto start = std::max<std::size_t>(first + count, prefetched_until);
+					const auto end = std::min<std::size_t>(first + count + readahead, size);
+					if (start < end) {
+						request_read(start, end - start, nullptr);
+						prefetched_until = end;
+					}
+				}
+
+				for (auto remaining = waiting; remaining; --remaining)
+					receive();
+			}
+
+			void write(block_index first, std::size_t count, const machine_word* words) override
+			{
+				for (std::size_t done {}; done < count;) {
+					const auto part = std::min<std::size_t>(count - done, max_block_request);
+					const auto tag = send_request(block_request::write, first + done, part, words + done * block_words);
+					outstanding.push_back({tag, block_request::write, static_cast<std::uint32_t>(first + done), part, nullptr});
+					for (std::size_t i {}; i < part; ++i) {
+						unacknowledged[first + done + i] = tag;
+						cache.insert(first + done + i, words + (done + i) * block_words);
+					}
+
+					done += part;
+					while (outstanding.size() > window)
+						receive();
+				}
+			}
+
+			void flush() override { drain(); }
+
+			void sync() override
+			{
+				const auto tag = send_request(block_request::sync, 0, 0, nullptr);
+				outstanding.push_back({tag, block_request::sync, 0, 0, nullptr});
+				drain();
+			}
+
+		private:
+			struct pending_request {
+				std::uint32_t tag;
+				block_request operation;
+				std::uint32_t first;
+				std::size_t count;
+				machine_word* destination;
+			};
+
+			static constexpr std::size_t window {64};
+			static constexpr std::size_t readahead {32};
+
+			unique_fd connection;
+			block_index size;
+			std::uint32_t next_tag;
+			std::deque<pending_request> outstanding;
+
+			// The tag of the latest write to each sector not yet acknowledged, so that a reply to a read sent before it
+			// can't put stale data in the cache
+			std::map<block_index, std::uint32_t> unacknowledged;
+
+			sector_cache cache;
+			std::vector<std::uint8_t> bytes;
+			std::size_t next_block;
+			std::size_t prefetched_until;
+
+			bool copy_cached(block_index first, std::size_t count, machine_word* words)
+			{
+				auto complete = true;
+				for (std::size_t i {}; i < count; ++i) {
+					if (const auto found = cache.find(first + i))
+						std::copy_n(found, block_words, words + i * block_words);
+					else
+						complete = false;
+				}
+
+				return complete;
+			}
+
+			std::uint32_t send_request(block_request operation, std::size_t first, std::size_t count, const machine_word* data)
+			{
+				const auto tag = next_tag++;
+				const block_request_header header {
+					operation,
+					tag,
+					static_cast<std::uint32_t>(first),
+					static_cast<std::uint32_t>(count)};
+
+				bytes.resize(sizeof(header) + (data ? count * block_size : 0));
+				std::memcpy(bytes.data(), &header, sizeof(header));
+				if (data)
+					pack_words(data, count * block_words, bytes.data() + sizeof(header));
+
+				send_fully(connection.get(), bytes.data(), bytes.size());
+				return tag;
+			}
+
+			void request_read(std::size_t first, std::size_t count, machine_word* destination)
+			{
+				const auto tag = send_request(block_request::read, first, count, nullptr);
+				outstanding.push_back({tag, block_request::read, static_cast<std::uint32_t>(first), count, destination});
+			}
+
+			block_reply_header receive_reply()
+			{
+				block_reply_header reply {};
+				if (!receive_fully(connection.get(), &reply, sizeof(reply)))
+					throw std::runtime_error {"disk server closed the connection"};
+
+				if (reply.error)
+					throw std::system_error {static_cast<int>(reply.error), std::generic_category(), "disk server"};
+
+				return reply;
+			}
+
+			void receive()
+			{
+				const auto request = outstanding.front();
+				outstanding.pop_front();
+				const auto reply = receive_reply();
+				if (reply.tag != request.tag || (request.operation == block_request::read && reply.count != request.count))
+					throw std::runtime_error {"disk server sent an unexpected reply"};
+
+				if (request.operation == block_request::write) {
+					for (std::size_t i {}; i < request.count; ++i) {
+						const auto found = unacknowledged.find(request.first + i);
+						if (found != unacknowledged.end() && found->second == request.tag)
+							unacknowledged.erase(found);
+					}
+				}
+				else if (request.operation == block_request::read) {
+					bytes.resize(request.count * block_size);
+					receive_fully(connection.get(), bytes.data(), bytes.size());
+					block_buffer words {};
+					for (std::size_t i {}; i < request.count; ++i) {
+						const auto block = static_cast<block_index>(request.first + i);
+						unpack_words(bytes.data() + i * block_size, block_words, words.data());
+						if (request.destination)
+							std::copy(words.begin(), words.end(), request.destination + i * block_words);
+
+						const auto found = unacknowledged.find(block);
+						if (found == unacknowledged.end() || found->second < request.tag)
+							cache.insert(block, words.data());
+					}
+				}
+			}
+
+			void drain()
+			{
+				while (!outstanding.empty())
+					receive();
+			}
+		};
+
+		// Keeps every write in a log-structured sector store beside an image that is only ever read. The store maps
+		// sectors to their data through a two-level table whose nodes are shared between snapshots, as in qcow2: taking a
+		// snapshot just retains the current root, and the first write to a shared node copies it (and, for a leaf, only
+		// its 256 entries). Sector data written since the latest snapshot or revert is overwritten in place; anything
+		// older belongs to a snapshot and is copied on write to the end of the store. Snapshots and reverts are logged
+		// too, so the full history is rebuilt when the store is reopened.
+		class overlay_disk final : public disk_backend {
+		public:
+			overlay_disk(std::unique_ptr<disk_backend> base, const std::string& path) :
+				base {std::move(base)},
+				store {open_file(path, O_RDWR | O_CREAT, 0644)},
+				store_size {},
+				epoch {},
+				current {std::make_shared<table>()},
+				snapshots {current}
+			{
+				replay();
+			}
+
+			block_index block_count() const noexcept override { return base->block_count(); }
+
+			void read(block_index first, std::size_t count, machine_word* words) override
+			{
+				block_bytes bytes {};
+				for (std::size_t i {}; i < count;) {
+					if (const auto found = lookup(first + i)) {
+						read_fully(store.get(), bytes.data(), bytes.size(), found->offset);
+						unpack_words(bytes.data(), block_words, words + i * block_words);
+						++i;
+						continue;
+					}
+
+					// Runs of sectors the overlay has never seen come straight from the image
+					auto end = i + 1;
+					while (end < count && !lookup(first + end))
+						++end;
+
+					base->read(first + i, end - i, words + i * block_words);
+					i = end;
+				}
+			}
+
+			void write(block_index first, std::size_t count, const machine_word* words) override
+			{
+				block_bytes bytes {};
+				for (std::size_t i {}; i < count; ++i) {
+					const block_index block = first + i;
+					pack_words(words + i * block_words, block_words, bytes.data());
+					auto& found = find(block);
+					if (found.offset && found.epoch == epoch) {
+						write_fully(store.get(), bytes.data(), bytes.size(), found.offset);
+					}
+					else {
+						append(write_record, block, &bytes);
+						found = {store_size - off_t {block_size}, epoch};
+					}
+				}
+			}
+
+			void sync() override
+			{
+				if (::fdatasync(store.get()) < 0)
+					throw_system_error("fdatasync");
+			}
+
+			std::optional<machine_word> snapshot() override
+			{
+				if (snapshots.size() > max_word)
+					return {};
+
+				const auto id = static_cast<machine_word>(snapshots.size());
+				append(snapshot_record, id);
+				snapshots.push_back(current);
+				++epoch;
+				return id;
+			}
+
+			bool revert(machine_word id) override
+			{
+				if (id >= snapshots.size())
+					return false;
+
+				append(revert_record, id);
+				current = snapshots[id];
+				++epoch;
+				return true;
+			}
+
+		private:
+			// Offset 0 is the store header, so it doubles as "not in the overlay"
+			struct entry {
+				off_t offset;
+				std::uint32_t epoch;
+			};
+
+			static constexpr std::size_t leaf_blocks {256};
+			using leaf = std::array<entry, leaf_blocks>;
+			using table = std::map<std::uint32_t, std::shared_ptr<leaf>>;
+
+			struct record_header {
+				std::uint32_t kind;
+				std::uint32_t value;
+				std::uint32_t checksum;
+			};
+
+			static constexpr std::uint32_t store_magic {0x4244'4f56};
+			static constexpr std::uint32_t write_record {0x5752'4954};
+			static constexpr std::uint32_t snapshot_record {0x534e'4150};
+			static constexpr std::uint32_t revert_record {0x5245'5654};
+
+			std::unique_ptr<disk_backend> base;
+			unique_fd store;
+			off_t store_size;
+			std::uint32_t epoch;
+			std::shared_ptr<table> current;
+			std::vector<std::shared_ptr<table>> snapshots;
+
+			const entry* lookup(std::uint32_t block) const
+			{
+				const auto node = current->find(block / leaf_blocks);
+				if (node == current->end())
+					return nullptr;
+
+				const auto& found = (*node->second)[block % leaf_blocks];
+				return found.offset ? &found : nullptr;
+			}
+
+			// Copies whichever nodes on the way to the entry are still shared with a snapshot
+			entry& find(std::uint32_t block)
+			{
+				if (current.use_count() > 1)
+					current = std::make_shared<table>(*current);
+
+				auto& node = (*current)[block / leaf_blocks];
+				if (!node)
+					node = std::make_shared<leaf>();
+				else if (node.use_count() > 1)
+					node = std::make_shared<leaf>(*node);
+
+				return (*node)[block % leaf_blocks];
+			}
+
+			static std::uint32_t checksum(const record_header& header) noexcept
+			{
+				return fnv1a(&header.value, sizeof(header.value), fnv1a(&header.kind, sizeof(header.kind)));
+			}
+
+			void append(std::uint32_t kind, std::uint32_t value, const block_bytes* data = nullptr)
+			{
+				record_header header {kind, value, 0};
+				header.checksum = checksum(header);
+				std::array<std::uint8_t, sizeof(header) + block_size> record {};
+				std::memcpy(record.data(), &header, sizeof(header));
+				if (data)
+					std::memcpy(record.data() + sizeof(header), data->data(), data->size());
+
+				const auto size = sizeof(header) + (data ? block_size : 0);
+				write_fully(store.get(), record.data(), size, store_size);
+				store_size += size;
+			}
+
+			// Reapplies the log to rebuild the table and snapshots, dropping a record torn by a crash. Only record
+			// headers are checksummed, since data written since the latest snapshot is overwritten in place.
+			void replay()
+			{
+				std::vector<std::uint8_t> contents(file_size(store.get()));
+				read_fully(store.get(), contents.data(), contents.size(), 0);
+				std::uint32_t magic {};
+				if (contents.size() < sizeof(magic)) {
+					magic = store_magic;
+					write_fully(store.get(), &magic, sizeof(magic), 0);
+					store_size = sizeof(magic);
+					return;
+				}
+
+				std::memcpy(&magic, contents.data(), sizeof(magic));
+				if (magic != store_magic)
+					throw std::runtime_error {"not a disk overlay"};
+
+				off_t offset = sizeof(magic);
+				while (contents.size() - offset >= sizeof(record_header)) {
+					record_header header {};
+					std::memcpy(&header, contents.data() + offset, sizeof(header));
+					if (header.checksum != checksum(header))
+						break;
+
+					if (header.kind == write_record && header.value < base->block_count()
+						&& contents.size() - offset - sizeof(header) >= block_size) {
+						offset += sizeof(header);
+						auto& found = find(header.value);
+						if (!found.offset || found.epoch != epoch)
+							found = {offset, epoch};
+
+						offset += block_size;
+					}
+					else if (header.kind == snapshot_record && header.value == snapshots.size()) {
+						offset += sizeof(header);
+						snapshots.push_back(current);
+						++epoch;
+					}
+					else if (header.kind == revert_record && header.value < snapshots.size()) {
+						offset += sizeof(header);
+						current = snapshots[header.value];
+						++epoch;
+					}
+					else {
+						break;
+					}
+				}
+
+				store_size = offset;
+				if (static_cast<std::size_t>(offset) != contents.size() && ::ftruncate(store.get(), offset) < 0)
+					throw_system_error("ftruncate");
+			}
+		};
+
+		// Keeps every write in memory, for a machine whose writes should be thrown away with it, such as a fork server's
+		// job. The disk underneath is only read.
+		class scratch_disk final : public disk_backend {
+		public:
+			scratch_disk(std::unique_ptr<disk_backend> base) : base {std::move(base)}, written {} {}
+
+			block_index block_count() const noexcept override { return base->block_count(); }
+
+			void read(block_index first, std::size_t count, machine_word* words) override
+			{
+				for (std::size_t i {}; i < count;) {
+					if (const auto found = written.find(first + i); found != written.end()) {
+						std::copy(found->second.begin(), found->second.end(), words + i * block_words);
+						++i;
+						continue;
+					}
+
+					auto end = i + 1;
+					while (end < count && !written.count(first + end))
+						++end;
+
+					base->read(first + i, end - i, words + i * block_words);
+					i = end;
+				}
+			}
+
+			void write(block_index first, std::size_t count, const machine_word* words) override
+			{
+				for (std::size_t i {}; i < count; ++i) {
+					const auto data = words + i * block_words;
+					std::copy(data, data + block_words, written[first + i].begin());
+				}
+			}
+
+		private:
+			std::unique_ptr<disk_backend> base;
+			std::unordered_map<block_index, std::array<machine_word, block_words>> written;
+		};
+
+		// Keeps the previous contents of every sector written, so that the debugger can take the disk back in time.
+		// Internal snapshots aren't offered, since reverting to one couldn't be undone.
+		class undo_disk final : public disk_backend {
+		public:
+			undo_disk(std::unique_ptr<disk_backend> base) : base {std::move(base)}, undo {}, forgotten {} {}
+
+			block_index block_count() const noexcept override { return base->block_count(); }
+
+			void read(block_index first, std::size_t count, machine_word* words) override
+			{
+				base->read(first, count, words);
+			}
+
+			void read_segments(block_index first, const std::vector<segment>& segments) override
+			{
+				base->read_segments(first, segments);
+			}
+
+			void write(block_index first, std::size_t count, const machine_word* words) override
+			{
+				std::vector<machine_word> previous(count * block_words);
+				base->read(first, count, previous.data());
+				undo.push_back({first, count, std::move(previous)});
+				base->write(first, count, words);
+			}
+
+			void poll(clock::time_point now) override { base->poll(now); }
+			void flush() override { base->flush(); }
+			void sync() override { base->sync(); }
+
+			// Counts every write since the disk was opened
+			std::size_t position() const noexcept { return forgotten + undo.size(); }
+
+			// Undoes the writes made since `position`
+			void rewind(std::size_t position)
+			{
+				while (this->position() > position) {
+					const auto& last = undo.back();
+					base->write(last.first, last.count, last.words.data());
+					undo.pop_back();
+				}
+			}
+
+			// Gives up the means to rewind to before `position`
+			void forget(std::size_t position)
+			{
+				for (; forgotten < position && !undo.empty(); ++forgotten)
+					undo.pop_front();
+			}
+
+		private:
+			struct undo_record {
+				block_index first;
+				std::size_t count;
+				std::vector<machine_word> words;
+			};
+
+			std::unique_ptr<disk_backend> base;
+			std::deque<undo_record> undo;
+			std::size_t forgotten;
+		};
+
+		// Keeps the contents of every sector read until finish(), as it was first read, except for sectors already written
+		// by then; these are everything a boot cache entry depends on from the disk
+		class boot_trace_disk final : public disk_backend {
+		public:
+			boot_trace_disk(std::unique_ptr<disk_backend> base) : base {std::move(base)}, inputs {}, written {}, tracing {true}
+			{
+			}
+
+			block_index block_count() const noexcept override { return base->block_count(); }
+
+			void read(block_index first, std::size_t count, machine_word* words) override
+			{
+				base->read(first, count, words);
+				note_read(first, count, words);
+			}
+
+			void write(block_index first, std::size_t count, const machine_word* words) override
+			{
+				note_write(first, count);
+				base->write(first, count, words);
+			}
+
+			void read_segments(block_index first, const std::vector<segment>& segments) override
+			{
+				base->read_segments(first, segments);
+				for (const auto& [words, count] : segments) {
+					note_read(first, count, words);
+					first += count;
+				}
+			}
+
+			void write_segments(block_index first, const std::vector<segment>& segments) override
+			{
+				note_write(first, total_blocks(segments));
+				base->write_segments(first, segments);
+			}
+
+			void poll(clock::time_point now) override { base->poll(now); }
+			void flush() override { base->flush(); }
+			void sync() override { base->sync(); }
+			std::optional<machine_word> snapshot() override { return base->snapshot(); }
+			bool revert(machine_word id) override { return base->revert(id); }
+
+			// Stops tracing, and hands over the sectors read so far
+			std::map<block_index, block_buffer> finish()
+			{
+				tracing = false;
+				written.clear();
+				return std::move(inputs);
+			}
+
+		private:
+			std::unique_ptr<disk_backend> base;
+			std::map<block_index, block_buffer> inputs;
+			std::unordered_set<block_index> written;
+			bool tracing;
+
+			void note_read(block_index first, std::size_t count, const machine_word* words)
+			{
+				if (!tracing)
+					return;
+
+				for (std::size_t i {}; i < count; ++i) {
+					const auto block = static_cast<block_index>(first + i);
+					if (written.count(block))
+						continue;
+
+					const auto [found, added] = inputs.try_emplace(block);
+					if (added)
+						std::copy_n(words + i * block_words, block_words, found->second.begin());
+				}
+			}
+
+			void note_write(block_index first, std::size_t count)
+			{
+				if (!tracing)
+					return;
+
+				for (std::size_t i {}; i < count; ++i) {
+					const auto block = static_cast<block_index>(first + i);
+					if (!inputs.count(block))
+						written.insert(block);
+				}
+			}
+		};
+
+		// Bucket i counts operations that took [2^i, 2^(i + 1)) nanoseconds of host time
+		struct latency_histogram {
+			std::array<std::uint64_t, 48> buckets {};
+			std::uint64_t count {};
+			std::uint64_t total_ns {};
+
+			void record(clock::duration elapsed) noexcept
+			{
+				const auto ns = static_cast<std::uint64_t>(
+					std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+
+				auto bucket = 0u;
+				while (bucket + 1 < buckets.size() && ns >> (bucket + 1))
+					++bucket;
+
+				++buckets[bucket];
+				++count;
+				total_ns += ns;
+			}
+		};
+
+		// Records the lifetime of the timer into the histogram, if there is one
+		class latency_timer {
+		public:
+			latency_timer(latency_histogram* histogram) :
+				histogram {histogram},
+				start {histogram ? clock::now() : clock::time_point {}}
+			{
+			}
+
+			latency_timer(const latency_timer&) = delete;
+			latency_timer& operator=(const latency_timer&) = delete;
+
+			~latency_timer()
+			{
+				if (histogram)
+					histogram->record(clock::now() - start);
+			}
+
+		private:
+			latency_histogram* histogram;
+			clock::time_point start;
+		};
+
+		struct disk_statistics {
+			std::uint64_t blocks_read {};
+			std::uint64_t blocks_written {};
+			std::uint64_t sequential_transfers {};
+			std::uint64_t random_transfers {};
+			std::uint64_t next_block {};
+			latency_histogram read_latency {};
+			latency_histogram write_latency {};
+			latency_histogram flush_latency {};
+			latency_histogram sync_latency {};
+		};
+
+		struct io_telemetry {
+			std::array<std::uint64_t, 1 << 16> port_reads {};
+			std::array<std::uint64_t, 1 << 16> port_writes {};
+			std::uint64_t serial_bytes_in {};
+			std::uint64_t serial_bytes_out {};
+			latency_histogram serial_read_latency {};
+			latency_histogram serial_write_latency {};
+			std::vector<disk_statistics> disks {};
+		};
+
+		// Counts the sectors moved through a backend and times every call into it. A transfer is sequential if it starts
+		// at the sector just past the end of the previous one.
+		class instrumented_disk final : public disk_backend {
+		public:
+			instrumented_disk(std::unique_ptr<disk_backend> disk, disk_statistics& statistics) :
+				disk {std::move(disk)},
+				statistics {statistics}
+			{
+			}
+
+			block_index block_count() const noexcept override { return disk->block_count(); }
+
+			void read(block_index first, std::size_t count, machine_word* words) override
+			{
+				note_transfer(first, count);
+				statistics.blocks_read += count;
+				const latency_timer timer {&statistics.read_latency};
+				disk->read(first, count, words);
+			}
+
+			void write(block_index first, std::size_t count, const machine_word* words) override
+			{
+				note_transfer(first, count);
+				statistics.blocks_written += count;
+				const latency_timer timer {&statistics.write_latency};
+				disk->write(first, count, words);
+			}
+
+			void read_segments(block_index first, const std::vector<segment>& segments) override
+			{
+				const auto count = total_blocks(segments);
+				note_transfer(first, count);
+				statistics.blocks_read += count;
+				const latency_timer timer {&statistics.read_latency};
+				disk->read_segments(first, segments);
+			}
+
+			void write_segments(block_index first, const std::vector<segment>& segments) override
+			{
+				const auto count = total_blocks(segments);
+				note_transfer(first, count);
+				statistics.blocks_written += count;
+				const latency_timer timer {&statistics.write_latency};
+				disk->write_segments(first, segments);
+			}
+
+			void poll(clock::time_point now) override { disk->poll(now); }
+			std::optional<machine_word> snapshot() override { return disk->snapshot(); }
+			bool revert(machine_word id) override { return disk->revert(id); }
+
+			void flush() override
+			{
+				const latency_timer timer {&statistics.flush_latency};
+				disk->flush();
+			}
+
+			void sync() override
+			{
+				const latency_timer timer {&statistics.sync_latency};
+				disk->sync();
+			}
+
+		private:
+			std::unique_ptr<disk_backend> disk;
+			disk_statistics& statistics;
+
+			void note_transfer(block_index first, std::size_t count) noexcept
+			{
+				++(first == statistics.next_block ? statistics.sequential_transfers : statistics.random_transfers);
+				statistics.next_block = first + count;
+			}
+		};
+
+		struct disk_options {
+			journal_options journal;
+			ramdisk_options ramdisk;
+			bool overlay {};
+			std::size_t coalesce_limit {};
+			std::optional<std::size_t> direct_cache_blocks;
+		};
+
+		constexpr std::string_view remote_prefix {"unix:"};
+
+		std::unique_ptr<disk_backend> open_disk(const char* path, const disk_options& options, disk_statistics* statistics)
+		{
+			if (!path)
+				return nullptr;
+
+			// unix:<socket>:<name> is the image <name> held by a disk server listening on <socket>
+			const std::string_view spec {path};
+			if (spec.substr(0, remote_prefix.size()) == remote_prefix) {
+				const auto separator = spec.rfind(':');
+				if (separator < remote_prefix.size() + 1)
+					throw std::runtime_error {"remote disks are named unix:<socket>:<image>"};
+
+				if (options.journal.enabled || options.ramdisk.enabled || options.overlay || options.coalesce_limit
+					|| options.direct_cache_blocks)
+					throw std::runtime_error {"remote disks only support --telemetry"};
+
+				const std::string socket {spec.substr(remote_prefix.size(), separator - remote_prefix.size())};
+				const std::string name {spec.substr(separator + 1)};
+				std::unique_ptr<disk_backend> disk {std::make_unique<remote_disk>(socket, name, 1024)};
+				if (statistics)
+					disk = std::make_unique<instrumented_disk>(std::move(disk), *statistics);
+
+				return disk;
+			}
+
+			// With an overlay, the image itself is never written
+			std::unique_ptr<disk_backend> disk {};
+			if (options.ramdisk.enabled) {
+				auto ramdisk = options.ramdisk;
+				if (options.overlay)
+					ramdisk.policy = write_back_policy::never;
+
+				disk = std::make_unique<ram_disk>(path, ramdisk);
+			}
+			else {
+				if (options.direct_cache_blocks)
+					disk = std::make_unique<direct_image>(path, !options.overlay, *options.direct_cache_blocks);
+				else
+					disk = std::make_unique<image_file>(path, !options.overlay, options.coalesce_limit);
+
+				if (options.journal.enabled) {
+					const auto journal_path = std::string {path} + ".journal";
+					disk = std::make_unique<journaled_disk>(std::move(disk), journal_path, options.journal);
+				}
+			}
+
+			if (options.overlay)
+				disk = std::make_unique<overlay_disk>(std::move(disk), std::string {path} + ".overlay");
+
+			if (statistics)
+				disk = std::make_unique<instrumented_disk>(std::move(disk), *statistics);
+
+			return disk;
+		}
+
+		void write_histogram(std::ostream& stream, const latency_histogram& histogram)
+		{
+			auto used = histogram.buckets.size();
+			while (used && !histogram.buckets[used - 1])
+				--used;
+
+			stream << "{\"count\": " << histogram.count << ", \"total_ns\": " << histogram.total_ns;
+			stream << ", \"log2_ns_buckets\": [";
+			for (std::size_t i {}; i < used; ++i)
+				stream << (i ? ", " : "") << histogram.buckets[i];
+
+			stream << "]}";
+		}
+
+		// Ports that were never accessed are left out
+		void write_telemetry(std::ostream& stream, const io_telemetry& telemetry)
+		{
+			stream << "{\n\t\"ports\": [";
+			auto first = true;
+			for (std::size_t port {}; port < telemetry.port_reads.size(); ++port) {
+				if (!telemetry.port_reads[port] && !telemetry.port_writes[port])
+					continue;
+
+				stream << (first ? "\n" : ",\n") << "\t\t{\"port\": " << port;
+				stream << ", \"reads\": " << telemetry.port_reads[port];
+				stream << ", \"writes\": " << telemetry.port_writes[port] << "}";
+				first = false;
+			}
+
+			stream << "\n\t],\n\t\"serial\": {\n";
+			stream << "\t\t\"bytes_in\": " << telemetry.serial_bytes_in << ",\n";
+			stream << "\t\t\"bytes_out\": " << telemetry.serial_bytes_out << ",\n";
+			stream << "\t\t\"read_latency\": ";
+			write_histogram(stream, telemetry.serial_read_latency);
+			stream << ",\n\t\t\"write_latency\": ";
+			write_histogram(stream, telemetry.serial_write_latency);
+			stream << "\n\t},\n\t\"disks\": [";
+			for (std::size_t i {}; i < telemetry.disks.size(); ++i) {
+				const auto& disk = telemetry.disks[i];
+				stream << (i ? ",\n" : "\n") << "\t\t{\n";
+				stream << "\t\t\t\"disk\": " << i << ",\n";
+				stream << "\t\t\t\"sectors_read\": " << disk.blocks_read << ",\n";
+				stream << "\t\t\t\"sectors_written\": " << disk.blocks_written << ",\n";
+				stream << "\t\t\t\"sequential_transfers\": " << disk.sequential_transfers << ",\n";
+				stream << "\t\t\t\"random_transfers\": " << disk.random_transfers << ",\n";
+				stream << "\t\t\t\"read_latency\": ";
+				write_histogram(stream, disk.read_latency);
+				stream << ",\n\t\t\t\"write_latency\": ";
+				write_histogram(stream, disk.write_latency);
+				stream << ",\n\t\t\t\"flush_latency\": ";
+				write_histogram(stream, disk.flush_latency);
+				stream << ",\n\t\t\t\"sync_latency\": ";
+				write_histogram(stream, disk.sync_latency);
+				stream << "\n\t\t}";
+			}
+
+			stream << "\n\t]\n}\n";
+		}
+
+		// Runs one job at a time on a thread of its own. An exception thrown by a job is rethrown by the next wait().
+		class disk_worker {
+		public:
+			disk_worker() : mutex {}, changed {}, job {}, working {}, stopping {}, error {}, thread {[this] { run(); }} {}
+
+			~disk_worker()
+			{
+				{
+					const std::lock_guard lock {mutex};
+					stopping = true;
+				}
+
+				changed.notify_all();
+				thread.join();
+			}
+
+			disk_worker(const disk_worker&) = delete;
+			disk_worker& operator=(const disk_worker&) = delete;
+
+			void start(std::function<void()> work)
+			{
+				{
+					const std::lock_guard lock {mutex};
+					job = std::move(work);
+					working = true;
+				}
+
+				changed.notify_all();
+			}
+
+			bool busy()
+			{
+				const std::lock_guard lock {mutex};
+				return working;
+			}
+
+			void wait()
+			{
+				std::unique_lock lock {mutex};
+				changed.wait(lock, [this] { return !working; });
+				if (error)
+					std::rethrow_exception(std::exchange(error, nullptr));
+			}
+
+		private:
+			std::mutex mutex;
+			std::condition_variable changed;
+			std::function<void()> job;
+			bool working;
+			bool stopping;
+			std::exception_ptr error;
+			std::thread thread;
+
+			void run()
+			{
+				std::unique_lock lock {mutex};
+				while (true) {
+					changed.wait(lock, [this] { return job || stopping; });
+					if (!job)
+						return;
+
+					const auto work = std::exchange(job, nullptr);
+					lock.unlock();
+					try {
+						work();
+					}
+					catch (...) {
+						lock.lock();
+						error = std::current_exception();
+						lock.unlock();
+					}
+
+					lock.lock();
+					working = false;
+					changed.notify_all();
+				}
+			}
+		};
+
+		// A transfer started by one of the issue commands. The worker only ever touches `buffer`, which is copied to or
+		// from guest memory on the machine's own thread, when the transfer is issued (writes) or completed (reads).
+		struct issued_transfer {
+			bool active;
+			bool write;
+			machine_word address;
+			std::vector<machine_word> buffer;
+		};
+
+		struct disk_controller {
+			std::unique_ptr<disk_backend> backend;
+			block_index block_count;
+			block_index block;
+			machine_word address;
+			machine_word transfer_count;
+			machine_word snapshot;
+			issued_transfer issued;
+
+			// Started by the first issue command or poll; while it is idle, the backend is only used from the machine's
+			// thread
+			std::unique_ptr<disk_worker> worker;
+
+			// Set for runs that must be reproducible: the status register then waits for an issued transfer instead of
+			// reporting it busy, which would depend on host timing
+			bool synchronous;
+
+			disk_controller(std::unique_ptr<disk_backend> disk) :
+				backend {std::move(disk)},
+				block_count {backend ? backend->block_count() : block_index {}},
+				block {},
+				address {},
+				transfer_count {},
+				snapshot {},
+				issued {},
+				worker {},
+				synchronous {}
+			{
+			}
+		};
+
+		constexpr std::array<machine_word, 40> firmware_blob {
+			0x2001, 0xeb00, 0x2b28, 0x2108, 0x0201, 0x210a, 0x0211, 0xc000, 0xf0c0, 0x00bb,
+			0xe20c, 0x210a, 0x6021, 0x2110, 0x0001, 0x00bb, 0x203a, 0x8002, 0x2118, 0x0101,
+			0x2030, 0x6002, 0x211a, 0x0111, 0x2057, 0x6002, 0x9f4f, 0xcf0f, 0x2201, 0x5ee2,
+			0x2003, 0xb00e, 0x2126, 0x0101, 0x50bd, 0x40f0, 0x5d2d, 0xe00c, 0x210a, 0x0001};
+
+		// Memory lives in a private mapping: anonymous, or of a saved state, whose pages are then only copied as the
+		// machine writes to them
+		class memory_adapter {
+		public:
+			static constexpr std::size_t size {(1 << 16) - firmware_blob.size()};
+
+			// Writes are tracked by page, counting from the end of the firmware
+			static constexpr std::size_t page_words {256};
+			static constexpr std::size_t page_count {(size + page_words - 1) / page_words};
+			using page_set = std::bitset<page_count>;
+
+			memory_adapter() :
+				storage {-1, size * word_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS},
+				memory {static_cast<machine_word*>(storage.get())},
+				dirty {}
+			{
+			}
+
+			// `offset` must be a multiple of the page size
+			void map(int fd, off_t offset)
+			{
+				storage = {fd, size * word_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, offset};
+				memory = static_cast<machine_word*>(storage.get());
+				dirty.set();
+			}
+
+			// Everything but the firmware, in native byte order
+			const machine_word* contents() const noexcept { return memory; }
+
+			static std::size_t page_length(std::size_t page) noexcept
+			{
+				return std::min(page_words, size - page * page_words);
+			}
+
+			const machine_word* page_contents(std::size_t page) const noexcept { return memory + page * page_words; }
+
+			// Does not count as a write
+			void restore_page(std::size_t page, const machine_word* words) noexcept
+			{
+				std::copy_n(words, page_length(page), memory + page * page_words);
+			}
+
+			// The pages written since the last call to clean()
+			const page_set& dirty_pages() const noexcept { return dirty; }
+			void clean() noexcept { dirty.reset(); }
+
+			void write(machine_word address, machine_word word)
+			{
+				if (address >= firmware_blob.size()) {
+					const auto index = address - firmware_blob.size();
+					memory[index] = word;
+					dirty[index / page_words] = true;
+				}
+			}
+
+			auto read(machine_word address)
+			{
+				if (address >= firmware_blob.size())
+					return memory[address - firmware_blob.size()];
+				else
+					return firmware_blob[address];
+			}
+
+			// Direct access to `count` words starting at `address`, or nullptr if the range wraps around the address
+			// space or overlaps the firmware. The range counts as written.
+			machine_word* data(machine_word address, std::size_t count)
+			{
+				if (address < firmware_blob.size() || address + count > (1 << 16))
+					return nullptr;
+
+				const auto index = address - firmware_blob.size();
+				for (auto page = index / page_words; count && page <= (index + count - 1) / page_words; ++page)
+					dirty[page] = true;
+
+				return memory + index;
+			}
+
+		private:
+			unique_mapping storage;
+			machine_word* memory;
+			page_set dirty;
+		};
+
+		struct dma_engine {
+			machine_word descriptors;
+			machine_word descriptor_count;
+			machine_word transferred;
+		};
+
+		enum class serial_flush_policy { line, full, periodic };
+
+		// Where serial port 0x0 leads: the emulator's own stdin and stdout, a console that connects to a Unix socket, a
+		// pseudo-terminal, or, in batch mode, input given up front and an output file
+		enum class serial_transport { stdio, unix_socket, pty, batch };
+
+		struct serial_options {
+			serial_flush_policy flush {serial_flush_policy::line};
+			std::chrono::milliseconds interval {};
+			serial_transport transport {serial_transport::stdio};
+			std::string socket_path {};
+
+			// For batch mode; no input means input has already ended, and no output means it is discarded. "-" stands
+			// for stdin or stdout.
+			std::string input_path {};
+			std::string output_path {};
+
+			// Where to keep a mapped_log of all output, if anywhere
+			std::string log_path {};
+		};
+
+		// Bytes passed from one producer thread to one consumer thread without locks: each side only ever advances its
+		// own index. Sequentially consistent indices let either side safely check the other before going to sleep.
+		class byte_ring {
+		public:
+			explicit byte_ring(std::size_t capacity) : bytes(capacity), head {}, tail {} {}
+
+			// Producer side: copies in as much as fits, and returns how much that was
+			std::size_t push(const std::uint8_t* data, std::size_t size)
+			{
+				const auto start = tail.load(std::memory_order_relaxed);
+				const auto count = std::min(size, bytes.size() - (start - head.load()));
+				for (std::size_t done {}; done < count;) {
+					const auto offset = (start + done) % bytes.size();
+					const auto run = std::min(count - done, bytes.size() - offset);
+					std::memcpy(bytes.data() + offset, data + done, run);
+					done += run;
+				}
+
+				tail.store(start + count);
+				return count;
+			}
+
+			// Consumer side: the next contiguous run of bytes, which stays put until consumed
+			std::pair<const std::uint8_t*, std::size_t> front() const
+			{
+				const auto start = head.load(std::memory_order_relaxed);
+				const auto offset = start % bytes.size();
+				return {bytes.data() + offset, std::min(tail.load() - start, bytes.size() - offset)};
+			}
+
+			void consume(std::size_t count) { head.store(head.load(std::memory_order_relaxed) + count); }
+
+			bool empty() const { return head.load() == tail.load(); }
+			bool full() const { return tail.load() - head.load() == bytes.size(); }
+
+		private:
+			std::vector<std::uint8_t> bytes;
+			std::atomic<std::size_t> head;
+			std::atomic<std::size_t> tail;
+		};
+
+		// An append-only log in a file that grows through a shared mapping, so that appending costs no system calls
+		// besides the occasional one to grow the file. The length of the log is published as a 64-bit counter mapped
+		// from <path>.tail, which readers can map too, to follow the log as it is written; at close, the log file is
+		// trimmed to exactly that length. Reopening a log appends to it.
+		class mapped_log {
+		public:
+			explicit mapped_log(const std::string& path) :
+				file {open_file(path, O_RDWR | O_CREAT, 0644)},
+				tail_file {open_file(path + ".tail", O_RDWR | O_CREAT, 0644)},
+				data {},
+				tail_mapping {},
+				tail {},
+				size {}
+			{
+				const auto existing = static_cast<std::uint64_t>(file_size(file.get()));
+				const auto resumed = file_size(tail_file.get()) >= off_t {sizeof(std::uint64_t)};
+				if (::ftruncate(tail_file.get(), sizeof(std::uint64_t)) < 0)
+					throw_system_error("ftruncate");
+
+				tail_mapping = {tail_file.get(), sizeof(std::uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED};
+				tail = static_cast<std::atomic<std::uint64_t>*>(tail_mapping.get());
+
+				// After a crash, the file runs on past the published length
+				size = resumed ? std::min(tail->load(), existing) : existing;
+				tail->store(size);
+				resize(std::max<std::size_t>(size * 2, minimum_capacity));
+			}
+
+			mapped_log(const mapped_log&) = delete;
+			mapped_log& operator=(const mapped_log&) = delete;
+
+			// Best effort: a log left at its mapped size is still good up to the published length
+			~mapped_log()
+			{
+				data.reset();
+				[[maybe_unused]] const auto result = ::ftruncate(file.get(), size);
+			}
+
+			void append(std::uint8_t byte)
+			{
+				if (size == data.size())
+					resize(data.size() * 2);
+
+				static_cast<std::uint8_t*>(data.get())[size++] = byte;
+				tail->store(size, std::memory_order_release);
+			}
+
+		private:
+			static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+			static constexpr std::size_t minimum_capacity {1 << 20};
+
+			unique_fd file;
+			unique_fd tail_file;
+			unique_mapping data;
+			unique_mapping tail_mapping;
+			std::atomic<std::uint64_t>* tail;
+			std::size_t size;
+
+			void resize(std::size_t capacity)
+			{
+				if (::ftruncate(file.get(), capacity) < 0)
+					throw_system_error("ftruncate");
+
+				if (data.get())
+					data.resize(capacity);
+				else
+					data = {file.get(), capacity, PROT_READ | PROT_WRITE, MAP_SHARED};
+			}
+		};
+
+		// Serial port 0x0 over raw file descriptors. Output collects in a buffer that is flushed as the flush policy
+		// allows (at every newline, only when full, or every `interval` while the machine runs), and in any case when it
+		// fills up, when the machine halts, and before waiting for input. Flushing only hands the bytes to a writer
+		// thread through a byte_ring, so the machine never waits on the host unless the ring is full or it halts. Input
+		// is read in bulk into a ring buffer by a thread of its own, started the first time the guest asks for input, so
+		// that the guest can poll for it.
+		//
+		// Over a Unix socket, the reader thread also accepts consoles, one at a time, and the port starts right away so
+		// that one can connect before the guest reads anything. Output is dropped while no console is connected, and
+		// when one disconnects, the next to connect takes its place. A pseudo-terminal is held open from both ends, so
+		// consoles can come and go on its slave side; output it can't take is dropped.
+		class serial_port {
+		public:
+			explicit serial_port(const serial_options& options) :
+				options {options},
+				listener {},
+				terminal {},
+				pending {},
+				oldest_pending {},
+				mutex {},
+				changed {},
+				input {},
+				output {},
+				ring(buffer_size),
+				head {},
+				tail {},
+				at_end {},
+				stopping {},
+				error {},
+				stop_reader {},
+				wake_reader {},
+				reader {},
+				outgoing {buffer_size},
+				writer_idle {},
+				flusher_waiting {},
+				writer_stopping {},
+				write_error {},
+				output_changed {},
+				writer {},
+				log {options.log_path.empty() ? nullptr : std::make_unique<mapped_log>(options.log_path)}
+			{
+				pending.reserve(buffer_size);
+				switch (options.transport) {
+				case serial_transport::stdio:
+					input = duplicate(STDIN_FILENO);
+					output = duplicate(STDOUT_FILENO);
+					break;
+
+				case serial_transport::unix_socket:
+					listener = listen_unix(options.socket_path);
+					start_reader();
+					break;
+
+				case serial_transport::pty:
+					input = output = open_terminal();
+					start_reader();
+					break;
+
+				case serial_transport::batch:
+					if (!options.input_path.empty())
+						load_input(options.input_path);
+
+					if (options.output_path == "-")
+						output = duplicate(STDOUT_FILENO);
+					else if (!options.output_path.empty())
+						output = std::make_shared<unique_fd>(
+							open_file(options.output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+
+					at_end = true;
+					break;
+				}
+			}
+
+			serial_port(const serial_port&) = delete;
+			serial_port& operator=(const serial_port&) = delete;
+
+			const serial_options& configuration() const noexcept { return options; }
+
+			~serial_port()
+			{
+				try {
+					drain();
+				}
+				catch (const std::exception&) {
+				}
+
+				if (writer.joinable()) {
+					{
+						const std::lock_guard lock {mutex};
+						writer_stopping = true;
+					}
+
+					output_changed.notify_all();
+					writer.join();
+				}
+
+				if (reader.joinable()) {
+					{
+						const std::lock_guard lock {mutex};
+						stopping = true;
+					}
+
+					changed.notify_all();
+					const std::uint8_t byte {};
+					while (::write(wake_reader.get(), &byte, 1) < 0 && errno == EINTR)
+						continue;
+
+					reader.join();
+				}
+
+				if (listener)
+					::unlink(options.socket_path.c_str());
+			}
+
+			void put(std::uint8_t byte)
+			{
+				if (log)
+					log->append(byte);
+
+				if (pending.empty())
+					oldest_pending = clock::now();
+
+				pending.push_back(byte);
+				if (pending.size() == buffer_size || (options.flush == serial_flush_policy::line && byte == '\n'))
+					flush();
+			}
+
+			// Blocks until a byte arrives; empty once the input has ended
+			std::optional<std::uint8_t> get()
+			{
+				start_reader();
+				std::unique_lock lock {mutex};
+				if (head == tail && !at_end) {
+					lock.unlock();
+					flush();
+					lock.lock();
+					changed.wait(lock, [this] { return head != tail || at_end; });
+				}
+
+				return take();
+			}
+
+			// Waits up to `timeout` for a byte to arrive or the input to end, and says whether either has
+			bool wait_for_input(std::chrono::milliseconds timeout)
+			{
+				start_reader();
+				std::unique_lock lock {mutex};
+				if (head != tail || at_end)
+					return true;
+
+				lock.unlock();
+				flush();
+				lock.lock();
+				return changed.wait_for(lock, timeout, [this] { return head != tail || at_end; });
+			}
+
+			// Empty if no byte has arrived yet
+			std::optional<std::uint8_t> try_get()
+			{
+				start_reader();
+				const std::lock_guard lock {mutex};
+				return take();
+			}
+
+			struct input_status {
+				std::size_t available;
+				bool ended;
+			};
+
+			input_status status()
+			{
+				start_reader();
+				const std::lock_guard lock {mutex};
+				if (error)
+					std::rethrow_exception(error);
+
+				return {tail - head, at_end && head == tail};
+			}
+
+			void poll(clock::time_point now)
+			{
+				if (options.flush == serial_flush_policy::periodic && !pending.empty()
+					&& now - oldest_pending >= options.interval)
+					flush();
+			}
+
+			// Hands the buffered output to the writer, waiting only for room in the ring
+			void flush()
+			{
+				// Output that could never go anywhere isn't worth a thread
+				if (!listener && !output)
+					pending.clear();
+
+				if (pending.empty())
+					return;
+
+				if (!writer.joinable())
+					writer = std::thread {[this] { write_output(); }};
+
+				for (std::size_t done {}; done < pending.size();) {
+					done += outgoing.push(pending.data() + done, pending.size() - done);
+					if (writer_idle) {
+						const std::lock_guard lock {mutex};
+						output_changed.notify_all();
+					}
+
+					if (done < pending.size())
+						wait_for_writer([this] { return !outgoing.full(); });
+				}
+
+				pending.clear();
+			}
+
+			// Flushes, then waits for the writer to finish with everything flushed so far
+			void drain()
+			{
+				flush();
+				wait_for_writer([this] { return outgoing.empty(); });
+			}
+
+		private:
+			static constexpr std::size_t buffer_size {1 << 16};
+
+			serial_options options;
+			unique_fd listener;
+
+			// Our own handle on a pseudo-terminal's slave side, so that it never hangs up
+			unique_fd terminal;
+
+			std::vector<std::uint8_t> pending;
+			clock::time_point oldest_pending;
+
+			// Bytes head through tail - 1 (modulo the ring size) are waiting to be read; the reader only ever writes past
+			// tail, so it can do so without holding the lock
+			std::mutex mutex;
+			std::condition_variable changed;
+			std::shared_ptr<unique_fd> input;
+			std::shared_ptr<unique_fd> output;
+			std::vector<std::uint8_t> ring;
+			std::size_t head;
+			std::size_t tail;
+			bool at_end;
+			bool stopping;
+			std::exception_ptr error;
+
+			// Written to by the destructor to get the reader out of poll()
+			unique_fd stop_reader;
+			unique_fd wake_reader;
+			std::thread reader;
+
+			// Flushed output on its way to the writer thread. The flags say who is asleep on output_changed, so that the
+			// other side only takes the lock when it has someone to wake; the rest is guarded by the lock.
+			byte_ring outgoing;
+			std::atomic<bool> writer_idle;
+			std::atomic<bool> flusher_waiting;
+			bool writer_stopping;
+			std::exception_ptr write_error;
+			std::condition_variable output_changed;
+			std::thread writer;
+
+			std::unique_ptr<mapped_log> log;
+
+			template <typename predicate>
+			void wait_for_writer(predicate done)
+			{
+				std::unique_lock lock {mutex};
+				flusher_waiting = true;
+				output_changed.wait(lock, [&] { return done() || write_error; });
+				flusher_waiting = false;
+				if (write_error)
+					std::rethrow_exception(write_error);
+			}
+
+			void write_output()
+			{
+				while (true) {
+					if (outgoing.empty()) {
+						std::unique_lock lock {mutex};
+						writer_idle = true;
+						output_changed.wait(lock, [this] { return !outgoing.empty() || writer_stopping; });
+						writer_idle = false;
+						if (outgoing.empty())
+							return;
+					}
+
+					// The reader may drop a console at any time, but this copy keeps its descriptor from being reused
+					std::shared_ptr<unique_fd> destination {};
+					{
+						const std::lock_guard lock {mutex};
+						destination = output;
+					}
+
+					const auto [data, size] = outgoing.front();
+					try {
+						write_to(destination.get(), data, size);
+					}
+					catch (...) {
+						const std::lock_guard lock {mutex};
+						write_error = std::current_exception();
+					}
+
+					outgoing.consume(size);
+					if (flusher_waiting) {
+						const std::lock_guard lock {mutex};
+						output_changed.notify_all();
+					}
+				}
+			}
+
+			// Output is dropped while there's nowhere for it to go
+			void write_to(const unique_fd* destination, const std::uint8_t* data, std::size_t size)
+			{
+				for (std::size_t done {}; destination && done < size;) {
+					const auto result = listener ? ::send(destination->get(), data + done, size - done, MSG_NOSIGNAL)
+												 : ::write(destination->get(), data + done, size - done);
+
+					if (result < 0 && (errno == EPIPE || errno == ECONNRESET || errno == EAGAIN))
+						break;
+					else if (result < 0 && errno != EINTR)
+						throw_system_error("serial write");
+					else if (result > 0)
+						done += result;
+				}
+			}
+
+			static std::shared_ptr<unique_fd> duplicate(int fd)
+			{
+				auto copy = std::make_shared<unique_fd>(::fcntl(fd, F_DUPFD_CLOEXEC, 0));
+				if (!*copy)
+					throw_system_error("dup");
+
+				return copy;
+			}
+
+			std::shared_ptr<unique_fd> open_terminal()
+			{
+				auto master = std::make_shared<unique_fd>(::posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK));
+				if (!*master || ::grantpt(master->get()) < 0 || ::unlockpt(master->get()) < 0)
+					throw_system_error("posix_openpt");
+
+				const std::string path {::ptsname(master->get())};
+				terminal = open_file(path, O_RDWR | O_NOCTTY);
+				termios settings {};
+				if (::tcgetattr(terminal.get(), &settings) < 0)
+					throw_system_error("tcgetattr");
+
+				::cfmakeraw(&settings);
+				if (::tcsetattr(terminal.get(), TCSANOW, &settings) < 0)
+					throw_system_error("tcsetattr");
+
+				std::cerr << "Serial port is at " << path << "\n";
+				return master;
+			}
+
+			// Batch input is read in full before the machine starts and served straight from the ring
+			void load_input(const std::string& path)
+			{
+				const auto file = path == "-" ? duplicate(STDIN_FILENO)
+											  : std::make_shared<unique_fd>(open_file(path, O_RDONLY));
+				ring.clear();
+				std::array<std::uint8_t, 1 << 16> chunk {};
+				while (true) {
+					const auto result = ::read(file->get(), chunk.data(), chunk.size());
+					if (result < 0 && errno != EINTR)
+						throw_system_error(path.c_str());
+					else if (result == 0)
+						break;
+					else if (result > 0)
+						ring.insert(ring.end(), chunk.begin(), chunk.begin() + result);
+				}
+
+				tail = ring.size();
+			}
+
+			// Requires the lock
+			std::optional<std::uint8_t> take()
+			{
+				if (error)
+					std::rethrow_exception(error);
+
+				if (head == tail)
+					return {};
+
+				// The reader only waits while the ring is full
+				if (tail - head == ring.size())
+					changed.notify_all();
+
+				return ring[head++ % ring.size()];
+			}
+
+			void start_reader()
+			{
+				if (reader.joinable() || at_end)
+					return;
+
+				int pipe[2] {};
+				if (::pipe2(pipe, O_CLOEXEC) < 0)
+					throw_system_error("pipe2");
+
+				stop_reader.reset(pipe[0]);
+				wake_reader.reset(pipe[1]);
+				reader = std::thread {[this] { read_input(); }};
+			}
+
+			void read_input()
+			{
+				std::unique_lock lock {mutex};
+				while (!at_end) {
+					changed.wait(lock, [this] { return tail - head < ring.size() || stopping; });
+					if (stopping)
+						return;
+
+					// Whatever is available, up to the free space left before the ring wraps, or else the next console
+					const auto source = input;
+					const auto start = tail % ring.size();
+					const auto space = std::min(ring.size() - (tail - head), ring.size() - start);
+					lock.unlock();
+					const auto watched = source ? source->get() : listener.get();
+					pollfd waiting[] {{watched, POLLIN, 0}, {stop_reader.get(), POLLIN, 0}};
+					auto result = ::poll(waiting, 2, -1);
+					if (result > 0 && !waiting[1].revents && source)
+						result = ::read(source->get(), ring.data() + start, space);
+					else if (result > 0 && !waiting[1].revents)
+						result = ::accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC);
+
+					lock.lock();
+					if (waiting[1].revents) {
+						at_end = true;
+					}
+					else if (!source && result >= 0) {
+						input = output = std::make_shared<unique_fd>(result);
+					}
+					else if (listener && (result == 0 || (result < 0 && errno != EINTR))) {
+						// A console hung up, or failed to connect; wait for the next one
+						input = output = nullptr;
+					}
+					else if (result < 0 && errno != EINTR && errno != EAGAIN) {
+						error = std::make_exception_ptr(std::system_error {errno, std::generic_category(), "serial read"});
+						at_end = true;
+					}
+					else if (result == 0) {
+						at_end = true;
+					}
+					else if (result > 0) {
+						tail += result;
+					}
+
+					changed.notify_all();
+				}
+			}
+		};
+
+		constexpr std::size_t max_disks {32};
+
+		struct disk_fingerprint {
+			block_index block_count;
+			std::uint32_t hash;
+		};
+
+		// Serial input as the machine saw it, by instruction count: every byte read, every read that found input at its
+		// end, and every change in the value of the status port. With the disks unchanged, that is all that can make one
+		// run differ from another, so replaying it reproduces the run exactly. A log without a file is kept in memory, for
+		// the debugger, which rewinds it to replay part of the run and records as usual once past the end.
+		class input_log {
+		public:
+			enum class event_kind : std::uint16_t { byte, end, status };
+
+			input_log() : file {}, replaying {}, history {true}, events {}, offset {}, next {}, status {} {}
+
+			input_log(const std::string& path, bool replaying, const std::vector<disk_fingerprint>& disks) :
+				file {open_file(path, replaying ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644)},
+				replaying {replaying},
+				history {},
+				events {},
+				offset {},
+				next {},
+				status {}
+			{
+				log_header header {};
+				if (!replaying) {
+					header.magic = log_magic;
+					header.version = log_version;
+					header.disk_count = static_cast<std::uint32_t>(disks.size());
+					std::copy(disks.begin(), disks.end(), header.disks.begin());
+					write_fully(file.get(), &header, sizeof(header), 0);
+					offset = sizeof(header);
+					return;
+				}
+
+				const auto size = file_size(file.get());
+				if (size < off_t {sizeof(header)} || (size - sizeof(header)) % sizeof(event))
+					throw std::runtime_error {"input log is truncated"};
+
+				read_fully(file.get(), &header, sizeof(header), 0);
+				if (header.magic != log_magic || header.version != log_version)
+					throw std::runtime_error {"not an input log of this version"};
+
+				if (header.disk_count != disks.size())
+					throw std::runtime_error {"input log was recorded with a different number of disks"};
+
+				for (std::size_t i {}; i < disks.size(); ++i) {
+					const auto& recorded = header.disks[i];
+					if (recorded.block_count != disks[i].block_count || recorded.hash != disks[i].hash)
+						throw std::runtime_error {"disk " + std::to_string(i) + " differs from the one recorded"};
+				}
+
+				events.resize((size - sizeof(header)) / sizeof(event));
+				read_fully(file.get(), events.data(), events.size() * sizeof(event), sizeof(header));
+			}
+
+			input_log(const input_log&) = delete;
+			input_log& operator=(const input_log&) = delete;
+
+			~input_log()
+			{
+				try {
+					flush();
+				}
+				catch (const std::exception&) {
+				}
+			}
+
+			bool replaying_log() const noexcept { return replaying || next < events.size(); }
+
+			// Only meaningful when replaying or in memory
+			std::size_t position() const noexcept { return next; }
+			machine_word last_status() const noexcept { return status; }
+
+			void rewind(std::size_t position, machine_word status) noexcept
+			{
+				next = position;
+				this->status = status;
+			}
+
+			// What a read of the serial port found; `waited` is for blocking reads, for which no byte means the end
+			void record_read(std::uint64_t instruction, std::optional<std::uint8_t> byte, bool waited)
+			{
+				if (byte)
+					append({instruction, event_kind::byte, *byte, 0});
+				else if (waited)
+					append({instruction, event_kind::end, 0, 0});
+			}
+
+			std::optional<std::uint8_t> replay_read(std::uint64_t instruction, bool waited)
+			{
+				if (take(instruction, event_kind::byte))
+					return static_cast<std::uint8_t>(events[next - 1].value);
+
+				if (waited && !take(instruction, event_kind::end))
+					throw std::runtime_error {"replay diverged at instruction " + std::to_string(instruction)};
+
+				return {};
+			}
+
+			void record_status(std::uint64_t instruction, machine_word value)
+			{
+				if (value != status)
+					append({instruction, event_kind::status, value, 0});
+
+				status = value;
+			}
+
+			machine_word replay_status(std::uint64_t instruction)
+			{
+				if (take(instruction, event_kind::status))
+					status = events[next - 1].value;
+
+				return status;
+			}
+
+			void flush()
+			{
+				if (replaying || history || events.empty())
+					return;
+
+				write_fully(file.get(), events.data(), events.size() * sizeof(event), offset);
+				offset += events.size() * sizeof(event);
+				events.clear();
+				next = 0;
+			}
+
+		private:
+			struct event {
+				std::uint64_t instruction;
+				event_kind kind;
+				machine_word value;
+				std::uint32_t reserved;
+			};
+
+			static constexpr std::array<char, 8> log_magic {'b', 'e', 'd', 'r', 'o', 'c', 'k', 'i'};
+			static constexpr std::uint32_t log_version {1};
+			static constexpr std::size_t buffered_events {4096};
+
+			struct log_header {
+				std::array<char, 8> magic;
+				std::uint32_t version;
+				std::uint32_t disk_count;
+				std::array<disk_fingerprint, max_disks> disks;
+			};
+
+			unique_fd file;
+			bool replaying;
+			bool history;
+			std::vector<event> events;
+			off_t offset;
+			std::size_t next;
+			machine_word status;
+
+			void append(const event& recorded)
+			{
+				events.push_back(recorded);
+				next = events.size();
+				if (events.size() == buffered_events)
+					flush();
+			}
+
+			bool take(std::uint64_t instruction, event_kind kind) noexcept
+			{
+				if (next == events.size() || events[next].instruction != instruction || events[next].kind != kind)
+					return false;
+
+				++next;
+				return true;
+			}
+		};
+
+		struct serial_dma_engine {
+			machine_word address;
+			machine_word count;
+			machine_word transferred;
+		};
+
+		// Read from the serial status port once input has ended, and from the non-blocking read port while no byte is
+		// waiting
+		constexpr machine_word serial_input_ended {0x8000};
+		constexpr machine_word serial_no_input {0xffff};
+
+		struct machine_state {
+			machine_word instruction_pointer;
+			machine_word high_word;
+			std::array<machine_word, 1 << 4> registers;
+			memory_adapter memory;
+
+			// Always at least two, for the original bus layout
+			std::vector<disk_controller> disks;
+
+			dma_engine dma;
+			std::unique_ptr<serial_port> serial;
+			serial_dma_engine serial_dma;
+
+			// The value last written to the halt port, zero while the machine runs
+			machine_word halt;
+			std::unique_ptr<io_telemetry> telemetry;
+
+			// Where a SIGUSR1 saves the machine, if anywhere
+			std::string save_path;
+
+			// Where a SIGUSR2 migrates the machine, if anywhere, and once it has begun, the connection to the target and
+			// the rounds of memory sent over it so far
+			std::string migrate_path;
+			unique_fd migration;
+			std::size_t migration_rounds;
+
+			// Set once the machine has moved to another emulator, along with `halt`, so that it stops here
+			bool migrated;
+
+			// How the disks were opened, to open them again if a migration fails after closing them
+			std::vector<const char*> disk_paths;
+			disk_options disk_settings;
+
+			// Where the machine is saved once it has booted, until then, along with what its boot read from the disks
+			std::string boot_cache_path;
+			std::vector<boot_trace_disk*> boot_traces;
+
+			// Where the machine waits for jobs once it has booted, until then
+			std::string fork_server_path;
+
+			// Counts from the start of execute(), to place recorded inputs
+			std::uint64_t instructions;
+			std::unique_ptr<input_log> inputs;
+
+			// Serial output is dropped up to this instruction count, when the debugger executes instructions again
+			std::uint64_t silent_until;
+
+			machine_state(
+				std::vector<std::unique_ptr<disk_backend>> backends,
+				const serial_options& serial,
+				std::unique_ptr<io_telemetry> telemetry) :
+				instruction_pointer {},
+				high_word {},
+				registers {},
+				memory {},
+				disks {},
+				dma {},
+				serial {std::make_unique<serial_port>(serial)},
+				serial_dma {},
+				halt {},
+				telemetry {std::move(telemetry)},
+				save_path {},
+				migrate_path {},
+				migration {},
+				migration_rounds {},
+				migrated {},
+				disk_paths {},
+				disk_settings {},
+				boot_cache_path {},
+				boot_traces {},
+				fork_server_path {},
+				instructions {},
+				inputs {},
+				silent_until {}
+			{
+				backends.resize(std::max<std::size_t>(backends.size(), 2));
+				for (auto& backend : backends)
+					disks.emplace_back(std::move(backend));
+			}
+		};
+
+		enum class disk_operation {
+			read_block,
+			write_block,
+			read_blocks,
+			write_blocks,
+			snapshot,
+			revert,
+			issue_read,
+			issue_write,
+			wait
+		};
+
+		// Controller n's extended registers sit at extended_disk_ports + n * extended_disk_stride, clear of the original
+		// three-port layout. Every controller's three original registers also appear at disk_ports + n * disk_stride,
+		// which is the only place to find them for controllers past disk1.
+		constexpr machine_word extended_disk_ports {0x0100};
+		constexpr machine_word extended_disk_stride {0x0008};
+		constexpr machine_word disk_ports {0x0200};
+		constexpr machine_word disk_stride {0x0003};
+
+		enum class disk_register : machine_word { command, block, address };
+
+		enum class extended_disk_register : machine_word {
+			transfer_count,
+			snapshot,
+			block_high,
+			size_low,
+			size_high,
+			status
+		};
+
+		enum class disk_status : machine_word { idle, busy };
+
+		// The original ports hold the low word of the sector number, and report sizes past 65535 sectors as 65535
+		constexpr machine_word low_word(block_index value) noexcept { return static_cast<machine_word>(value); }
+		constexpr machine_word high_word(block_index value) noexcept { return static_cast<machine_word>(value >> 16); }
+
+		constexpr machine_word legacy_block_count(block_index count) noexcept
+		{
+			return count < max_word ? static_cast<machine_word>(count) : max_word;
+		}
+
+		void set_low_word(block_index& value, machine_word word) noexcept { value = (value & 0xffff'0000) | word; }
+		void set_high_word(block_index& value, machine_word word) noexcept
+		{
+			value = (value & 0xffff) | block_index {word} << 16;
+		}
+
+		// Sectors past the end of the disk are skipped, and memory addresses wrap around the address space
+		void transfer_blocks(disk_controller& disk, memory_adapter& memory, bool write, std::size_t count)
+		{
+			count = std::min<std::size_t>(count, disk.block < disk.block_count ? disk.block_count - disk.block : 0);
+			if (!count)
+				return;
+
+			// Sectors are transferred straight to and from guest memory, unless the range wraps or touches firmware
+			const auto words = count * block_words;
+			if (const auto direct = memory.data(disk.address, words)) {
+				if (write)
+					disk.backend->write(disk.block, count, direct);
+				else
+					disk.backend->read(disk.block, count, direct);
+
+				return;
+			}
+
+			std::vector<machine_word> buffer(words);
+			if (write) {
+				for (std::size_t i {}; i < words; ++i)
+					buffer[i] = memory.read(disk.address + i);
+
+				disk.backend->write(disk.block, count, buffer.data());
+			}
+			else {
+				disk.backend->read(disk.block, count, buffer.data());
+				for (std::size_t i {}; i < words; ++i)
+					memory.write(disk.address + i, buffer[i]);
+			}
+		}
+
+		// Waits for anything the controller's worker is doing, and delivers the read data of an issued transfer to guest
+		// memory. Anything else that uses the backend must call this first.
+		void complete_transfer(disk_controller& disk, memory_adapter& memory)
+		{
+			if (disk.worker)
+				disk.worker->wait();
+
+			auto& issued = disk.issued;
+			if (!issued.active)
+				return;
+
+			issued.active = false;
+			for (std::size_t i {}; !issued.write && i < issued.buffer.size(); ++i)
+				memory.write(issued.address + i, issued.buffer[i]);
+		}
+
+		// Like transfer_blocks(), but hands the transfer to the controller's worker and returns immediately
+		void issue_transfer(disk_controller& disk, memory_adapter& memory, bool write, std::size_t count)
+		{
+			complete_transfer(disk, memory);
+			count = std::min<std::size_t>(count, disk.block < disk.block_count ? disk.block_count - disk.block : 0);
+			if (!count)
+				return;
+
+			auto& issued = disk.issued;
+			issued = {true, write, disk.address, std::move(issued.buffer)};
+			issued.buffer.resize(count * block_words);
+			for (std::size_t i {}; write && i < issued.buffer.size(); ++i)
+				issued.buffer[i] = memory.read(disk.address + i);
+
+			if (!disk.worker)
+				disk.worker = std::make_unique<disk_worker>();
+
+			const auto backend = disk.backend.get();
+			disk.worker->start([backend, first = disk.block, count, write, words = issued.buffer.data()] {
+				if (write)
+					backend->write(first, count, words);
+				else
+					backend->read(first, count, words);
+			});
+		}
+
+		bool transfer_running(disk_controller& disk)
+		{
+			return disk.issued.active && !disk.synchronous && disk.worker->busy();
+		}
+
+		disk_status transfer_status(disk_controller& disk, memory_adapter& memory)
+		{
+			if (transfer_running(disk))
+				return disk_status::busy;
+
+			complete_transfer(disk, memory);
+			return disk_status::idle;
+		}
+
+		void do_disk_operation(disk_controller& disk, memory_adapter& memory, machine_word control)
+		{
+			if (!disk.backend)
+				return;
+
+			const auto operation = static_cast<disk_operation>(control);
+			if (operation == disk_operation::issue_read || operation == disk_operation::issue_write) {
+				issue_transfer(disk, memory, operation == disk_operation::issue_write, disk.transfer_count);
+				return;
+			}
+
+			complete_transfer(disk, memory);
+			switch (operation) {
+			case disk_operation::read_block:
+				transfer_blocks(disk, memory, false, 1);
+				break;
+
+			case disk_operation::write_block:
+				transfer_blocks(disk, memory, true, 1);
+				break;
+
+			case disk_operation::read_blocks:
+				transfer_blocks(disk, memory, false, disk.transfer_count);
+				break;
+
+			case disk_operation::write_blocks:
+				transfer_blocks(disk, memory, true, disk.transfer_count);
+				break;
+
+			case disk_operation::snapshot:
+				if (const auto id = disk.backend->snapshot())
+					disk.snapshot = *id;
+
+				break;
+
+			case disk_operation::revert:
+				disk.backend->revert(disk.snapshot);
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		disk_controller* find_disk(machine_state& state, std::size_t index)
+		{
+			return index < state.disks.size() ? &state.disks[index] : nullptr;
+		}
+
+		// run_extended takes descriptors with a sixth word, the high word of the first sector, following the low one
+		enum class dma_command { run = 1, run_extended };
+
+		struct dma_descriptor {
+			machine_word command;
+			machine_word disk;
+			block_index block;
+			machine_word address;
+			machine_word count;
+		};
+
+		// Executes the descriptor list in order. Each descriptor is five words: a disk command (0x0 read, 0x1 write), the
+		// disk number, the first sector, the memory address, and the sector count; extended descriptors give the first
+		// sector as two words, low then high. The list is read in full before any transfer starts, and a run of
+		// descriptors that each pick up on the same disk where the previous left off is handed to the backend as one
+		// scatter-gather transfer.
+		void run_dma(machine_state& state, bool extended)
+		{
+			std::vector<dma_descriptor> descriptors(state.dma.descriptor_count);
+			auto address = state.dma.descriptors;
+			for (auto& descriptor : descriptors) {
+				descriptor.command = state.memory.read(address++);
+				descriptor.disk = state.memory.read(address++);
+				descriptor.block = state.memory.read(address++);
+				if (extended)
+					set_high_word(descriptor.block, state.memory.read(address++));
+
+				descriptor.address = state.memory.read(address++);
+				descriptor.count = state.memory.read(address++);
+			}
+
+			struct bounce {
+				machine_word address;
+				std::vector<machine_word> words;
+			};
+
+			std::uint32_t transferred {};
+			std::vector<disk_backend::segment> segments {};
+			std::vector<bounce> bounces {};
+			for (std::size_t i {}; i < descriptors.size();) {
+				const auto& head = descriptors[i];
+				const auto disk = find_disk(state, head.disk);
+				const auto command = static_cast<disk_operation>(head.command);
+				if (!disk || !disk->backend
+					|| (command != disk_operation::read_block && command != disk_operation::write_block)) {
+					++i;
+					continue;
+				}
+
+				complete_transfer(*disk, state.memory);
+
+				const auto write = command == disk_operation::write_block;
+				segments.clear();
+				bounces.clear();
+				auto next_block = head.block;
+				do {
+					const auto& descriptor = descriptors[i++];
+					const auto available = next_block < disk->block_count ? disk->block_count - next_block : 0;
+					const auto count = std::min<std::size_t>(descriptor.count, available);
+					if (!count)
+						continue;
+
+					const auto words = count * block_words;
+					if (const auto direct = state.memory.data(descriptor.address, words)) {
+						segments.push_back({direct, count});
+					}
+					else {
+						auto& buffer = bounces.emplace_back(bounce {descriptor.address, std::vector<machine_word>(words)});
+						for (std::size_t j {}; write && j < words; ++j)
+							buffer.words[j] = state.memory.read(descriptor.address + j);
+
+						segments.push_back({buffer.words.data(), count});
+					}
+
+					next_block += count;
+				} while (i < descriptors.size() && descriptors[i].command == head.command
+						 && descriptors[i].disk == head.disk && descriptors[i].block == next_block);
+
+				if (segments.empty())
+					continue;
+
+				if (write) {
+					disk->backend->write_segments(head.block, segments);
+				}
+				else {
+					disk->backend->read_segments(head.block, segments);
+					for (const auto& buffer : bounces) {
+						for (std::size_t j {}; j < buffer.words.size(); ++j)
+							state.memory.write(buffer.address + j, buffer.words[j]);
+					}
+				}
+
+				transferred += next_block - head.block;
+			}
+
+			state.dma.transferred = transferred < max_word ? static_cast<machine_word>(transferred) : max_word;
+		}
+
+		void poll_devices(machine_state& state)
+		{
+			const auto now = clock::now();
+			state.serial->poll(now);
+			if (state.inputs)
+				state.inputs->flush();
+
+			// Backend housekeeping (journal commits, write-backs, queued writes) runs on the controller's worker, so the
+			// machine only waits for it if it next uses the disk before it's done
+			for (auto& disk : state.disks) {
+				if (!disk.backend || (disk.worker && disk.worker->busy()))
+					continue;
+
+				if (!disk.worker)
+					disk.worker = std::make_unique<disk_worker>();
+
+				disk.worker->start([backend = disk.backend.get(), now] { backend->poll(now); });
+			}
+		}
+
+		void flush_devices(machine_state& state)
+		{
+			for (auto& disk : state.disks) {
+				complete_transfer(disk, state.memory);
+				if (disk.backend)
+					disk.backend->flush();
+			}
+
+			state.serial->drain();
+			if (state.inputs)
+				state.inputs->flush();
+		}
+
+		// Save states are a header page and then memory, in native byte order, so that restoring maps memory straight
+		// from the file. Disks are not copied: an overlay takes a snapshot that the restore reverts to, and any other
+		// disk must be left as it was
+		constexpr std::array<char, 8> state_magic {'b', 'e', 'd', 'r', 'o', 'c', 'k', 's'};
+		constexpr std::uint32_t state_version {1};
+		constexpr std::size_t state_header_size {4096};
+		constexpr std::uint32_t no_disk_snapshot {0xffffffff};
+		constexpr std::size_t state_size {state_header_size + memory_adapter::size * word_size};
+
+		struct saved_disk {
+			block_index block_count;
+			block_index block;
+			machine_word address;
+			machine_word transfer_count;
+			machine_word snapshot;
+			std::uint32_t backend_snapshot;
+		};
+
+		struct state_header {
+			std::array<char, 8> magic;
+			std::uint32_t version;
+			std::uint32_t memory_words;
+			machine_word instruction_pointer;
+			machine_word high_word;
+			std::array<machine_word, 1 << 4> registers;
+			dma_engine dma;
+			serial_dma_engine serial_dma;
+			std::uint32_t disk_count;
+			std::array<saved_disk, max_disks> disks;
+		};
+
+		static_assert(sizeof(state_header) <= state_header_size);
+
+		// Everything but memory, after flush_devices(); with `snapshot_disks`, disks that keep internal snapshots take one
+		state_header capture_state(machine_state& state, bool snapshot_disks)
+		{
+			state_header header {};
+			header.magic = state_magic;
+			header.version = state_version;
+			header.memory_words = memory_adapter::size;
+			header.instruction_pointer = state.instruction_pointer;
+			header.high_word = state.high_word;
+			header.registers = state.registers;
+			header.dma = state.dma;
+			header.serial_dma = state.serial_dma;
+			header.disk_count = static_cast<std::uint32_t>(state.disks.size());
+			for (std::size_t i {}; i < state.disks.size(); ++i) {
+				auto& disk = state.disks[i];
+				std::optional<machine_word> id {};
+				if (disk.backend && snapshot_disks)
+					id = disk.backend->snapshot();
+
+				header.disks[i] = {
+					disk.block_count,
+					disk.block,
+					disk.address,
+					disk.transfer_count,
+					disk.snapshot,
+					id ? *id : no_disk_snapshot};
+			}
+
+			return header;
+		}
+
+		// Checks that `header` is of this machine before applying any of it, reverting disks to their snapshots
+		void apply_state(machine_state& state, const state_header& header)
+		{
+			if (header.magic != state_magic || header.version != state_version)
+				throw std::runtime_error {"not a saved machine of this version"};
+
+			if (header.memory_words != memory_adapter::size || header.disk_count != state.disks.size())
+				throw std::runtime_error {"saved machine has different hardware"};
+
+			for (std::size_t i {}; i < state.disks.size(); ++i) {
+				const auto& saved = header.disks[i];
+				if (saved.block_count != state.disks[i].block_count)
+					throw std::runtime_error {"saved machine has a disk of a different size"};
+			}
+
+			for (std::size_t i {}; i < state.disks.size(); ++i) {
+				const auto& saved = header.disks[i];
+				auto& disk = state.disks[i];
+				complete_transfer(disk, state.memory);
+				if (saved.backend_snapshot != no_disk_snapshot
+					&& !(disk.backend && disk.backend->revert(static_cast<machine_word>(saved.backend_snapshot))))
+					throw std::runtime_error {"saved machine needs a disk snapshot that is missing"};
+
+				disk.block = saved.block;
+				disk.address = saved.address;
+				disk.transfer_count = saved.transfer_count;
+				disk.snapshot = saved.snapshot;
+			}
+
+			state.instruction_pointer = header.instruction_pointer;
+			state.high_word = header.high_word;
+			state.registers = header.registers;
+			state.dma = header.dma;
+			state.serial_dma = header.serial_dma;
+		}
+
+		// Input the host has buffered but the guest has not yet read is not part of the state. `appendix` follows memory,
+		// where restoring ignores it.
+		void save_state(machine_state& state, const std::string& path, const std::vector<std::uint8_t>& appendix = {})
+		{
+			flush_devices(state);
+			const auto header = capture_state(state, true);
+
+			// Written beside the old state and renamed over it, so that a machine restored from it keeps its mapping. The
+			// name is this process's own, since runs sharing a boot cache may fill the same entry at once; whichever
+			// rename comes last wins, with an equally good save.
+			const auto temporary = path + "." + std::to_string(::getpid()) + ".new";
+			{
+				const auto file = open_file(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				std::array<char, state_header_size> page {};
+				std::memcpy(page.data(), &header, sizeof(header));
+				write_fully(file.get(), page.data(), page.size(), 0);
+				write_fully(file.get(), state.memory.contents(), memory_adapter::size * word_size, state_header_size);
+				if (!appendix.empty())
+					write_fully(file.get(), appendix.data(), appendix.size(), state_size);
+			}
+
+			if (::rename(temporary.c_str(), path.c_str()) < 0)
+				throw_system_error("rename");
+		}
+
+		// Memory is mapped copy-on-write from the file, so this costs the same for any amount of it
+		void restore_state(machine_state& state, const std::string& path)
+		{
+			const auto file = open_file(path, O_RDONLY);
+			state_header header {};
+			if (file_size(file.get()) < static_cast<off_t>(state_size))
+				throw std::runtime_error {"save state is truncated"};
+
+			read_fully(file.get(), &header, sizeof(header), 0);
+			apply_state(state, header);
+			state.memory.map(file.get(), state_header_size);
+		}
+
+		// Live migration begins with a migration_offer, which the target answers with a byte, nonzero if it has the same
+		// memory and disks. Pages of memory follow, each as its index and then its words, ending with the index
+		// end_of_pages and a state_header; the target answers with another byte once it has taken over.
+		constexpr std::uint32_t end_of_pages {0xffffffff};
+
+		struct migration_offer {
+			std::array<char, 8> magic;
+			std::uint32_t version;
+			std::uint32_t memory_words;
+			std::uint32_t disk_count;
+			std::array<std::uint32_t, max_disks> block_counts;
+
+			// A hash of each disk's canonical path, or of its name on a disk server; zero for a disconnected disk
+			std::array<std::uint32_t, max_disks> identities;
+		};
+
+		// Describes the disks at `paths` without opening them, since the source of a migration still has them open.
+		// Only a disk server knows the size of a remote disk.
+		migration_offer describe_machine(const std::vector<const char*>& paths)
+		{
+			migration_offer offer {
+				state_magic,
+				state_version,
+				memory_adapter::size,
+				static_cast<std::uint32_t>(paths.size()),
+				{},
+				{}};
+
+			for (std::size_t i {}; i < paths.size() && i < max_disks; ++i) {
+				if (!paths[i])
+					continue;
+
+				std::string identity {paths[i]};
+				if (std::string_view {identity}.substr(0, remote_prefix.size()) != remote_prefix) {
+					identity = std::filesystem::canonical(paths[i]).string();
+					const auto n_blocks = std::filesystem::file_size(paths[i]) / block_size;
+					offer.block_counts[i] = n_blocks < max_block_index ? static_cast<block_index>(n_blocks) : max_block_index;
+				}
+
+				offer.identities[i] = fnv1a(identity.data(), identity.size());
+			}
+
+			return offer;
+		}
+
+		// Connects to the target, which turns the machine away if it doesn't have the same disks
+		void begin_migration(machine_state& state)
+		{
+			state.migration = connect_unix(state.migrate_path);
+			const auto offer = describe_machine(state.disk_paths);
+			send_fully(state.migration.get(), &offer, sizeof(offer));
+			std::uint8_t accepted {};
+			if (!receive_fully(state.migration.get(), &accepted, sizeof(accepted)) || !accepted)
+				throw std::runtime_error {"migration target turned the machine away"};
+		}
+
+		// Leaves the machine running here, with any disks that were closed for the target opened again
+		void abandon_migration(machine_state& state)
+		{
+			state.migration.reset();
+			state.migration_rounds = 0;
+			for (std::size_t i {}; i < state.disk_paths.size(); ++i) {
+				auto& disk = state.disks[i];
+				if (!disk.backend && state.disk_paths[i]) {
+					const auto statistics = state.telemetry ? &state.telemetry->disks[i] : nullptr;
+					disk.backend = open_disk(state.disk_paths[i], state.disk_settings, statistics);
+				}
+			}
+		}
+
+		// Sends the pages written since the last round, or every page
+		std::size_t send_pages(machine_state& state, bool all)
+		{
+			const auto& dirty = state.memory.dirty_pages();
+			std::size_t sent {};
+			for (std::uint32_t page {}; page < dirty.size(); ++page) {
+				if (!all && !dirty[page])
+					continue;
+
+				send_fully(state.migration.get(), &page, sizeof(page));
+				send_fully(
+					state.migration.get(),
+					state.memory.page_contents(page),
+					memory_adapter::page_length(page) * word_size);
+
+				++sent;
+			}
+
+			state.memory.clean();
+			return sent;
+		}
+
+		// Stops the machine and sends the rest of it. The disks are closed before the target opens them.
+		void finish_migration(machine_state& state)
+		{
+			flush_devices(state);
+			const auto header = capture_state(state, false);
+			const auto stopped_pages = send_pages(state, false);
+			for (auto& disk : state.disks)
+				disk.backend.reset();
+
+			send_fully(state.migration.get(), &end_of_pages, sizeof(end_of_pages));
+			send_fully(state.migration.get(), &header, sizeof(header));
+			std::uint8_t done {};
+			if (!receive_fully(state.migration.get(), &done, sizeof(done)))
+				throw std::runtime_error {"migration target failed to take over"};
+
+			state.migration.reset();
+			state.migrated = true;
+			state.halt = 1;
+			std::cerr << "Migrated after " << state.migration_rounds << " rounds, with " << stopped_pages
+					  << " pages copied while stopped.\n";
+		}
+
+		constexpr std::size_t migration_final_pages {8};
+		constexpr std::size_t migration_max_rounds {30};
+
+		// Copies memory to the target in rounds while the machine runs, each sending the pages written since the last,
+		// until few enough are left to stop the machine and send the rest with everything else
+		void migration_round(machine_state& state)
+		{
+			const auto dirty = state.memory.dirty_pages().count();
+			const auto rounds = state.migration_rounds;
+			if (rounds && (dirty <= migration_final_pages || rounds == migration_max_rounds)) {
+				finish_migration(state);
+				return;
+			}
+
+			send_pages(state, !rounds);
+			++state.migration_rounds;
+		}
+
+		struct incoming_machine {
+			unique_fd connection;
+			std::vector<machine_word> memory;
+			state_header header;
+		};
+
+		// Waits for a machine to migrate here, before the disks are opened
+		incoming_machine receive_machine(const std::string& path, const migration_offer& expected)
+		{
+			incoming_machine incoming {{}, std::vector<machine_word>(memory_adapter::size), {}};
+			{
+				const auto listener = listen_unix(path);
+				while (!incoming.connection) {
+					incoming.connection = unique_fd {::accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC)};
+					if (!incoming.connection && errno != EINTR && errno != ECONNABORTED)
+						throw_system_error("accept");
+				}
+
+				::unlink(path.c_str());
+			}
+
+			const auto fd = incoming.connection.get();
+			migration_offer offer {};
+			if (!receive_fully(fd, &offer, sizeof(offer)))
+				throw std::runtime_error {"migration source hung up"};
+
+			const std::uint8_t accepted {std::memcmp(&offer, &expected, sizeof(offer)) == 0};
+			send_fully(fd, &accepted, sizeof(accepted));
+			if (!accepted)
+				throw std::runtime_error {"migration source has different memory or disks"};
+
+			while (true) {
+				std::uint32_t page {};
+				if (!receive_fully(fd, &page, sizeof(page)))
+					throw std::runtime_error {"migration source hung up"};
+
+				if (page == end_of_pages)
+					break;
+
+				if (page >= memory_adapter::page_count)
+					throw std::runtime_error {"migration stream is corrupt"};
+
+				const auto words = incoming.memory.data() + page * memory_adapter::page_words;
+				if (!receive_fully(fd, words, memory_adapter::page_length(page) * word_size))
+					throw std::runtime_error {"migration source hung up"};
+			}
+
+			if (!receive_fully(fd, &incoming.header, sizeof(incoming.header)))
+				throw std::runtime_error {"migration source hung up"};
+
+			return incoming;
+		}
+
+		// Resumes the migrated machine here, once its disks are open
+		void take_over(machine_state& state, const incoming_machine& incoming)
+		{
+			apply_state(state, incoming.header);
+			for (std::size_t page {}; page < memory_adapter::page_count; ++page)
+				state.memory.restore_page(page, incoming.memory.data() + page * memory_adapter::page_words);
+
+			const std::uint8_t done {1};
+			send_fully(incoming.connection.get(), &done, sizeof(done));
+		}
+
+		// Entries made before boot inputs were kept have none, so they would always match
+		constexpr std::uint32_t boot_cache_version {2};
+
+		// Boot cache entries are named for everything a boot depends on before it reads the disks: the firmware, the disks
+		// attached, and whether they are overlays, which saves require. Each save is followed by what the boot then read,
+		// as a boot_input for every sector.
+		std::string boot_cache_entry(machine_state& state, const std::filesystem::path& directory, bool overlay)
+		{
+			auto hash = fnv1a(&state_version, sizeof(state_version));
+			hash = fnv1a(&boot_cache_version, sizeof(boot_cache_version), hash);
+			hash = fnv1a(firmware_blob.data(), firmware_blob.size() * word_size, hash);
+			for (const auto& disk : state.disks) {
+				const bool attached {disk.backend};
+				hash = fnv1a(&attached, sizeof(attached), hash);
+				hash = fnv1a(&disk.block_count, sizeof(disk.block_count), hash);
+			}
+
+			hash = fnv1a(&overlay, sizeof(overlay), hash);
+
+			std::array<char, 8> name {};
+			const auto end = std::to_chars(name.data(), name.data() + name.size(), hash, 16).ptr;
+			return (directory / (std::string(name.data(), end) + ".state")).string();
+		}
+
+		struct boot_input {
+			std::uint32_t disk;
+			std::uint32_t block;
+			block_buffer words;
+		};
+
+		// Whether the disks still hold everything the boot saved in the entry read from them
+		bool boot_inputs_match(machine_state& state, const std::string& entry)
+		{
+			const auto file = open_file(entry, O_RDONLY);
+			const auto size = file_size(file.get());
+			if (size < static_cast<off_t>(state_size) || (size - state_size) % sizeof(boot_input))
+				return false;
+
+			boot_input saved {};
+			block_buffer current {};
+			for (off_t offset = state_size; offset < size; offset += sizeof(saved)) {
+				read_fully(file.get(), &saved, sizeof(saved), offset);
+				if (saved.disk >= state.disks.size())
+					return false;
+
+				auto& disk = state.disks[saved.disk];
+				if (!disk.backend || saved.block >= disk.block_count)
+					return false;
+
+				disk.backend->read(saved.block, 1, current.data());
+				if (current != saved.words)
+					return false;
+			}
+
+			return true;
+		}
+
+		// Traces what the boot reads from every disk, for a boot cache entry
+		void trace_boot(machine_state& state)
+		{
+			for (auto& disk : state.disks) {
+				auto trace = disk.backend ? std::make_unique<boot_trace_disk>(std::move(disk.backend)) : nullptr;
+				state.boot_traces.push_back(trace.get());
+				disk.backend = std::move(trace);
+			}
+		}
+
+		// Called once the disks are idle; the traces' sectors, as boot_inputs
+		std::vector<std::uint8_t> finish_boot_trace(machine_state& state)
+		{
+			std::vector<std::uint8_t> inputs {};
+			const auto traces = std::exchange(state.boot_traces, {});
+			for (std::uint32_t i {}; i < traces.size(); ++i) {
+				if (!traces[i])
+					continue;
+
+				for (const auto& [block, words] : traces[i]->finish()) {
+					const boot_input input {i, block, words};
+					const auto bytes = reinterpret_cast<const std::uint8_t*>(&input);
+					inputs.insert(inputs.end(), bytes, bytes + sizeof(input));
+				}
+			}
+
+			return inputs;
+		}
+
+		// Hashes every disk in full, as its backend presents it, so that a replay can tell whether it has the same disks
+		std::vector<disk_fingerprint> fingerprint_disks(machine_state& state)
+		{
+			constexpr std::size_t chunk_blocks {256};
+			std::vector<machine_word> chunk(chunk_blocks * block_words);
+			std::vector<disk_fingerprint> fingerprints {};
+			for (auto& disk : state.disks) {
+				auto hash = fnv1a(nullptr, 0);
+				for (std::size_t first {}; first < disk.block_count; first += chunk_blocks) {
+					const auto count = std::min<std::size_t>(chunk_blocks, disk.block_count - first);
+					disk.backend->read(static_cast<block_index>(first), count, chunk.data());
+					hash = fnv1a(chunk.data(), count * block_size, hash);
+				}
+
+				fingerprints.push_back({disk.block_count, hash});
+			}
+
+			return fingerprints;
+		}
+
+		instruction_word decode(machine_word word) noexcept
+		{
+			const auto op = (word & 0xf000) >> 12;
+			const auto destination = (word & 0x0f00) >> 8;
+			const auto source1 = (word & 0x00f0) >> 4;
+			const auto source0 = word & 0x000f;
+			return {
+				static_cast<opcode>(op),
+				static_cast<std::uint8_t>(destination),
+				static_cast<std::uint8_t>(source1),
+				static_cast<std::uint8_t>(source0)};
+		}
+
+		disk_controller* extended_disk(machine_state& state, machine_word port)
+		{
+			if (port < extended_disk_ports || port >= extended_disk_ports + max_disks * extended_disk_stride)
+				return nullptr;
+
+			return find_disk(state, (port - extended_disk_ports) / extended_disk_stride);
+		}
+
+		disk_controller* relocated_disk(machine_state& state, machine_word port)
+		{
+			if (port < disk_ports || port >= disk_ports + max_disks * disk_stride)
+				return nullptr;
+
+			return find_disk(state, (port - disk_ports) / disk_stride);
+		}
+
+		machine_word read_disk_register(const disk_controller& disk, machine_word offset)
+		{
+			switch (static_cast<disk_register>(offset)) {
+			case disk_register::command:
+				return legacy_block_count(disk.block_count);
+
+			case disk_register::block:
+				return low_word(disk.block);
+
+			case disk_register::address:
+				return disk.address;
+
+			default:
+				return 0;
+			}
+		}
+
+		void write_disk_register(disk_controller& disk, memory_adapter& memory, machine_word offset, machine_word word)
+		{
+			switch (static_cast<disk_register>(offset)) {
+			case disk_register::command:
+				do_disk_operation(disk, memory, word);
+				break;
+
+			case disk_register::block:
+				set_low_word(disk.block, word);
+				break;
+
+			case disk_register::address:
+				disk.address = word;
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		machine_word read_extended_register(disk_controller& disk, memory_adapter& memory, machine_word offset)
+		{
+			switch (static_cast<extended_disk_register>(offset)) {
+			case extended_disk_register::transfer_count:
+				return disk.transfer_count;
+
+			case extended_disk_register::snapshot:
+				return disk.snapshot;
+
+			case extended_disk_register::block_high:
+				return high_word(disk.block);
+
+			case extended_disk_register::size_low:
+				return low_word(disk.block_count);
+
+			case extended_disk_register::size_high:
+				return high_word(disk.block_count);
+
+			case extended_disk_register::status:
+				return static_cast<machine_word>(transfer_status(disk, memory));
+
+			default:
+				return 0;
+			}
+		}
+
+		void write_extended_register(disk_controller& disk, machine_word offset, machine_word word)
+		{
+			switch (static_cast<extended_disk_register>(offset)) {
+			case extended_disk_register::transfer_count:
+				disk.transfer_count = word;
+				break;
+
+			case extended_disk_register::snapshot:
+				disk.snapshot = word;
+				break;
+
+			case extended_disk_register::block_high:
+				set_high_word(disk.block, word);
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		// Turns a forked copy of the machine into a job: the parent's threads don't exist here, so their owners are
+		// abandoned rather than destroyed, and disk writes are kept to the job
+		void start_job(machine_state& state, const std::array<unique_fd, 2>& serial)
+		{
+			for (auto& disk : state.disks) {
+				disk.worker.release();
+				if (disk.backend)
+					disk.backend = std::make_unique<scratch_disk>(std::move(disk.backend));
+			}
+
+			if (::dup2(serial[0].get(), STDIN_FILENO) < 0 || ::dup2(serial[1].get(), STDOUT_FILENO) < 0)
+				throw_system_error("dup2");
+
+			auto options = state.serial->configuration();
+			options.log_path.clear();
+			if (options.transport == serial_transport::batch)
+				options.input_path = options.output_path = "-";
+			else
+				options.transport = serial_transport::stdio;
+
+			state.serial.release();
+			state.serial = std::make_unique<serial_port>(options);
+
+			// The disks still count into the telemetry, which is never written out
+			state.telemetry.release();
+			state.save_path.clear();
+		}
+
+		// Forks a job from the machine as it is now for each connection to the fork server's socket, and reports the
+		// job's exit status back on it. Only returns in a job, which carries on with the access that reached the boot point.
+		void serve_forks(machine_state& state)
+		{
+			const auto listener = listen_unix(std::exchange(state.fork_server_path, {}));
+			flush_devices(state);
+			while (true) {
+				unique_fd connection {::accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC)};
+				if (!connection && errno != EINTR && errno != ECONNABORTED)
+					throw_system_error("accept");
+				else if (!connection)
+					continue;
+
+				const auto serial = receive_descriptors(connection.get());
+				if (!serial)
+					continue;
+
+				const auto pid = ::fork();
+				if (pid < 0)
+					throw_system_error("fork");
+
+				if (pid == 0) {
+					start_job(state, *serial);
+					return;
+				}
+
+				std::thread {[pid, connection = std::move(connection)] {
+					int status {};
+					while (::waitpid(pid, &status, 0) < 0 && errno == EINTR)
+						continue;
+
+					const std::int32_t code {WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status)};
+					try {
+						send_fully(connection.get(), &code, sizeof(code));
+					}
+					catch (std::exception&) {
+					}
+				}}.detach();
+			}
+		}
+
+		// Returns the job's exit status
+		int submit_job(const char* socket_path)
+		{
+			const auto connection = connect_unix(socket_path);
+			send_descriptors(connection.get(), {STDIN_FILENO, STDOUT_FILENO});
+			std::int32_t code {};
+			if (!receive_fully(connection.get(), &code, sizeof(code)))
+				throw std::runtime_error {"fork server dropped the job"};
+
+			return code;
+		}
+
+		volatile std::sig_atomic_t interrupted {};
+
+		void request_interrupt(int) { interrupted = 1; }
+
+		// Thrown out of an instruction that was waiting for serial input when the debugger was interrupted, once the
+		// machine has been put back to just before it
+		struct read_interrupted {};
+
+		volatile std::sig_atomic_t save_requested {};
+
+		void request_save(int) { save_requested = 1; }
+
+		volatile std::sig_atomic_t migrate_requested {};
+
+		void request_migration(int) { migrate_requested = 1; }
+
+		// Carries out what signals have asked for since the last call, for a machine that would be resumed at
+		// `resume_at`; called only between instructions, or from an access that can be made again from the start
+		void serve_requests(machine_state& state, machine_word resume_at)
+		{
+			if (save_requested && !state.save_path.empty()) {
+				save_requested = 0;
+				const auto instruction_pointer = std::exchange(state.instruction_pointer, resume_at);
+				save_state(state, state.save_path);
+				state.instruction_pointer = instruction_pointer;
+			}
+
+			// A migration that fails leaves the machine running here
+			if ((migrate_requested && !state.migrate_path.empty()) || state.migration) {
+				migrate_requested = 0;
+				const auto instruction_pointer = std::exchange(state.instruction_pointer, resume_at);
+				try {
+					if (!state.migration)
+						begin_migration(state);
+
+					migration_round(state);
+				}
+				catch (const std::exception& error) {
+					abandon_migration(state);
+					std::cerr << "Migration failed, so the machine carries on here: \"" << error.what() << "\"\n";
+				}
+
+				state.instruction_pointer = instruction_pointer;
+			}
+		}
+
+		// How often devices are polled while the machine waits for serial input
+		constexpr std::chrono::milliseconds idle_poll_interval {10};
+
+		// Every serial input the machine sees goes through read_serial() or serial_status(), to be recorded or replayed.
+		// A `restartable` read is the first thing its instruction does, which can be made again from the start.
+		std::optional<std::uint8_t> read_serial(machine_state& state, bool wait, bool restartable)
+		{
+			if (state.inputs && state.inputs->replaying_log())
+				return state.inputs->replay_read(state.instructions, wait);
+
+			// Timed disk work, like journal commits, mustn't wait for a guest idling at a prompt, and nor must saves and
+			// migrations
+			if (wait) {
+				while (!state.serial->wait_for_input(idle_poll_interval)) {
+					poll_devices(state);
+					if (restartable)
+						serve_requests(state, state.instruction_pointer - 1);
+
+					if (state.migrated)
+						return {};
+
+					if (interrupted && restartable) {
+						--state.instruction_pointer;
+						--state.instructions;
+						throw read_interrupted {};
+					}
+				}
+			}
+
+			const auto byte = wait ? state.serial->get() : state.serial->try_get();
+			if (state.inputs)
+				state.inputs->record_read(state.instructions, byte, wait);
+
+			return byte;
+		}
+
+		machine_word serial_status(machine_state& state)
+		{
+			if (state.inputs && state.inputs->replaying_log())
+				return state.inputs->replay_status(state.instructions);
+
+			const auto [available, ended] = state.serial->status();
+			const auto count = static_cast<machine_word>(std::min<std::size_t>(available, serial_input_ended - 1));
+			const auto value = ended ? serial_input_ended : count;
+			if (state.inputs)
+				state.inputs->record_status(state.instructions, value);
+
+			return value;
+		}
+
+		void write_serial(machine_state& state, std::uint8_t byte)
+		{
+			if (state.instructions > state.silent_until)
+				state.serial->put(byte);
+		}
+
+		enum class serial_dma_command { write_bytes = 1, write_words, read_bytes, read_line };
+
+		// Moves a span of memory to or from the serial port in one command, and counts the words of memory it covered.
+		// Bytes are stored one to a word, in the low byte; write_words instead sends both bytes of every word, high byte
+		// first. read_bytes waits for the first byte and then takes whatever else has already arrived, and read_line
+		// stops after a newline; both stop early if input ends.
+		void run_serial_dma(machine_state& state, serial_dma_command command)
+		{
+			auto& dma = state.serial_dma;
+			std::size_t bytes_in {};
+			std::size_t bytes_out {};
+			dma.transferred = 0;
+			switch (command) {
+			case serial_dma_command::write_bytes:
+			case serial_dma_command::write_words: {
+				const auto words = command == serial_dma_command::write_words;
+				for (machine_word i {}; i < dma.count; ++i) {
+					const auto word = state.memory.read(dma.address + i);
+					if (words)
+						write_serial(state, word >> 8);
+
+					write_serial(state, word & 0xff);
+				}
+
+				dma.transferred = dma.count;
+				bytes_out = words ? dma.count * std::size_t {2} : dma.count;
+				break;
+			}
+
+			case serial_dma_command::read_bytes:
+			case serial_dma_command::read_line: {
+				const auto line = command == serial_dma_command::read_line;
+				while (dma.transferred < dma.count) {
+					const auto byte = read_serial(state, !dma.transferred || line, !dma.transferred);
+					if (!byte)
+						break;
+
+					state.memory.write(dma.address + dma.transferred++, *byte);
+					if (line && *byte == '\n')
+						break;
+				}
+
+				bytes_in = dma.transferred;
+				break;
+			}
+
+			default:
+				break;
+			}
+
+			if (state.telemetry) {
+				state.telemetry->serial_bytes_in += bytes_in;
+				state.telemetry->serial_bytes_out += bytes_out;
+			}
+		}
+
+		// The machine counts as booted when it first looks for serial input, or writes to the checkpoint port. It is saved
+		// to resume at `resume_at`, so that a read is made again after a restore, and then forked.
+		void reach_boot_point(machine_state& state, machine_word resume_at)
+		{
+			if (!state.boot_cache_path.empty()) {
+				const auto path = std::exchange(state.boot_cache_path, {});
+				flush_devices(state);
+				const auto inputs = finish_boot_trace(state);
+				const auto instruction_pointer = std::exchange(state.instruction_pointer, resume_at);
+				save_state(state, path, inputs);
+				state.instruction_pointer = instruction_pointer;
+			}
+
+			if (!state.fork_server_path.empty())
+				serve_forks(state);
+		}
+
+		void do_bus_read(machine_state& state, const instruction_word& instruction)
+		{
+			const auto port = state.registers[instruction.source0];
+			if (state.telemetry)
+				++state.telemetry->port_reads[port];
+
+			if (port == 0x0000 || port == 0x0008 || port == 0x0009)
+				reach_boot_point(state, state.instruction_pointer - 1);
+
+			switch (port) {
+			case 0x0000: {
+				const latency_timer timer {state.telemetry ? &state.telemetry->serial_read_latency : nullptr};
+				const auto byte = read_serial(state, true, true);
+				state.registers[instruction.destination] = byte.value_or(0xff);
+				if (state.telemetry && byte)
+					++state.telemetry->serial_bytes_in;
+
+				break;
+			}
+
+			case 0x0001:
+			case 0x0002:
+			case 0x0003:
+				state.registers[instruction.destination] = read_disk_register(state.disks[0], port - 0x0001);
+				break;
+
+			case 0x0004:
+			case 0x0005:
+			case 0x0006:
+				state.registers[instruction.destination] = read_disk_register(state.disks[1], port - 0x0004);
+				break;
+
+			case 0x0008:
+				state.registers[instruction.destination] = serial_status(state);
+				break;
+
+			case 0x0009: {
+				const auto byte = read_serial(state, false, false);
+				state.registers[instruction.destination] = byte ? *byte : serial_no_input;
+				if (state.telemetry && byte)
+					++state.telemetry->serial_bytes_in;
+
+				break;
+			}
+
+			case 0x000a:
+				state.registers[instruction.destination] = state.serial_dma.address;
+				break;
+
+			case 0x000b:
+				state.registers[instruction.destination] = state.serial_dma.count;
+				break;
+
+			case 0x000c:
+				state.registers[instruction.destination] = state.serial_dma.transferred;
+				break;
+
+			case 0x0010:
+				state.registers[instruction.destination] = state.dma.descriptors;
+				break;
+
+			case 0x0011:
+				state.registers[instruction.destination] = state.dma.descriptor_count;
+				break;
+
+			case 0x0012:
+				state.registers[instruction.destination] = state.dma.transferred;
+				break;
+
+			default:
+				if (const auto disk = relocated_disk(state, port))
+					state.registers[instruction.destination] = read_disk_register(*disk, (port - disk_ports) % disk_stride);
+				else if (const auto disk = extended_disk(state, port))
+					state.registers[instruction.destination] = read_extended_register(*disk, state.memory, port % extended_disk_stride);
+				else
+					state.registers[instruction.destination] = 0;
+
+				break;
+			}
+		}
+
+		void do_bus_write(machine_state& state, const instruction_word& instruction)
+		{
+			const auto port = state.registers[instruction.source0];
+			const auto word = state.registers[instruction.source1];
+			if (state.telemetry)
+				++state.telemetry->port_writes[port];
+
+			switch (port) {
+			case 0x0000: {
+				const latency_timer timer {state.telemetry ? &state.telemetry->serial_write_latency : nullptr};
+				write_serial(state, word & 0xff);
+				if (state.telemetry)
+					++state.telemetry->serial_bytes_out;
+
+				break;
+			}
+
+			case 0x0001:
+			case 0x0002:
+			case 0x0003:
+				write_disk_register(state.disks[0], state.memory, port - 0x0001, word);
+				break;
+
+			case 0x0004:
+			case 0x0005:
+			case 0x0006:
+				write_disk_register(state.disks[1], state.memory, port - 0x0004, word);
+				break;
+
+			case 0x0007:
+				state.halt = word;
+				break;
+
+			case 0x000a:
+				state.serial_dma.address = word;
+				break;
+
+			case 0x000b:
+				state.serial_dma.count = word;
+				break;
+
+			case 0x000c: {
+				const auto command = static_cast<serial_dma_command>(word);
+				const auto reading = command == serial_dma_command::read_bytes || command == serial_dma_command::read_line;
+				if (reading)
+					reach_boot_point(state, state.instruction_pointer - 1);
+
+				const latency_timer timer {
+					!state.telemetry ? nullptr
+					: reading		 ? &state.telemetry->serial_read_latency
+									 : &state.telemetry->serial_write_latency};
+
+				run_serial_dma(state, command);
+				break;
+			}
+
+			case 0x0010:
+				state.dma.descriptors = word;
+				break;
+
+			case 0x0011:
+				state.dma.descriptor_count = word;
+				break;
+
+			case 0x0012: {
+				const auto command = static_cast<dma_command>(word);
+				if (command == dma_command::run || command == dma_command::run_extended)
+					run_dma(state, command == dma_command::run_extended);
+
+				break;
+			}
+
+			case 0x0018:
+				reach_boot_point(state, state.instruction_pointer);
+				break;
+
+			default:
+				if (const auto disk = relocated_disk(state, port))
+					write_disk_register(*disk, state.memory, (port - disk_ports) % disk_stride, word);
+				else if (const auto disk = extended_disk(state, port))
+					write_extended_register(*disk, port % extended_disk_stride, word);
+
+				break;
+			}
+		}
+
+		// Instructions executed between calls to poll_devices()
+		constexpr auto poll_interval = 1u << 16;
+
+		// Runs the machine until it halts, or until its instruction count reaches `limit`. Devices are polled whenever
+		// the count reaches a multiple of poll_interval; in between, only halts need checking.
+		void run(machine_state& state, std::uint64_t limit)
+		{
+			while (!state.halt && state.instructions != limit) {
+				const auto until_poll = poll_interval - state.instructions % poll_interval;
+				for (auto burst = std::min<std::uint64_t>(until_poll, limit - state.instructions); burst && !state.halt;
+					 --burst) {
+					++state.instructions;
+					const auto instruction = decode(state.memory.read(state.instruction_pointer++));
+					switch (instruction.op) {
+					case opcode::jump:
+						if (state.registers[instruction.source1]) {
+							const auto link = state.instruction_pointer;
+							state.instruction_pointer = state.registers[instruction.source0];
+							state.registers[instruction.destination] = link;
+						}
+
+						break;
+
+					case opcode::read_high:
+						state.registers[instruction.destination] = state.high_word;
+						break;
+
+					case opcode::set:
+						state.registers[instruction.destination] = instruction.source1 << 4 | instruction.source0;
+						break;
+
+					case opcode::load:
+						state.registers[instruction.destination] = state.memory.read(state.registers[instruction.source0]);
+						break;
+
+					case opcode::store:
+						state.memory.write(state.registers[instruction.source0], state.registers[instruction.source1]);
+						break;
+
+					case opcode::add: {
+						const std::uint32_t a {state.registers[instruction.source0]};
+						const std::uint32_t b {state.registers[instruction.source1]};
+						const auto c = a + b;
+						state.registers[instruction.destination] = c & 0xffff;
+						state.high_word = c >> 16;
+						break;
+					}
+
+					case opcode::subtract: {
+						const std::uint32_t a {state.registers[instruction.source0]};
+						const std::uint32_t b {state.registers[instruction.source1]};
+						const auto c = a - b;
+						state.registers[instruction.destination] = c & 0xffff;
+						state.high_word = c >> 16;
+						break;
+					}
+
+					case opcode::multiply: {
+						const std::uint32_t a {state.registers[instruction.source0]};
+						const std::uint32_t b {state.registers[instruction.source1]};
+						const auto c = a * b;
+						state.registers[instruction.destination] = c & 0xffff;
+						state.high_word = c >> 16;
+						break;
+					}
+
+					case opcode::divide: {
+						const std::uint32_t a {state.registers[instruction.source0]};
+						const std::uint32_t b {state.registers[instruction.source1]};
+						const std::uint32_t c {b ? a / b : 0xffffffff};
+						state.registers[instruction.destination] = c & 0xffff;
+						state.high_word = c >> 16;
+						break;
+					}
+
+					case opcode::shift_left:
+						state.registers[instruction.destination] = state.registers[instruction.source0]
+							<< instruction.source1;
+
+						break;
+
+					case opcode::shift_right:
+						state.registers[instruction.destination]
+							= state.registers[instruction.source0] >> instruction.source1;
+
+						break;
+
+					case opcode::logic_and:
+						state.registers[instruction.destination]
+							= state.registers[instruction.source0] & state.registers[instruction.source1];
+
+						break;
+
+					case opcode::logic_or:
+						state.registers[instruction.destination]
+							= state.registers[instruction.source0] | state.registers[instruction.source1];
+
+						break;
+
+					case opcode::logic_not:
+						state.registers[instruction.destination] = ~state.registers[instruction.source0];
+						break;
+
+					case opcode::bus_read:
+						do_bus_read(state, instruction);
+						break;
+
+					case opcode::bus_write:
+						do_bus_write(state, instruction);
+						break;
+					}
+				}
+
+				if (state.instructions % poll_interval == 0) {
+					poll_devices(state);
+					serve_requests(state, state.instruction_pointer);
+				}
+			}
+		}
+
+		void execute(machine_state& state)
+		{
+			run(state, std::numeric_limits<std::uint64_t>::max());
+		}
+
+		bool parse_number(std::string_view text, unsigned& value)
+		{
+			const auto end = text.data() + text.size();
+			const auto [last, error] = std::from_chars(text.data(), end, value);
+			return !text.empty() && error == std::errc {} && last == end;
+		}
+
+		// An interactive debugger on stdin and stdout that can run the machine backwards. Every `interval` instructions
+		// it takes a checkpoint of the machine's registers, the memory pages written since the previous checkpoint, as
+		// they were then, and positions in the disks' undo logs and the serial input history. Going back restores the
+		// latest checkpoint before the target and executes forward from there, which reproduces the run exactly: serial
+		// input comes from the history, and output that was already written is dropped.
+		class debugger {
+		public:
+			debugger(machine_state& state, std::uint64_t interval) :
+				state {state},
+				interval {interval},
+				checkpoints {},
+				shadow(memory_adapter::size),
+				disks {},
+				breakpoints(1 << 16),
+				furthest {state.instructions}
+			{
+				if (!state.inputs)
+					state.inputs = std::make_unique<input_log>();
+
+				for (auto& disk : state.disks) {
+					disk.synchronous = true;
+					if (!disk.backend) {
+						disks.push_back(nullptr);
+						continue;
+					}
+
+					auto undo = std::make_unique<undo_disk>(std::move(disk.backend));
+					disks.push_back(undo.get());
+					disk.backend = std::move(undo);
+				}
+
+				std::copy_n(state.memory.contents(), shadow.size(), shadow.begin());
+				state.memory.clean();
+				take_checkpoint();
+			}
+
+			void interact()
+			{
+				struct sigaction action {};
+				action.sa_handler = request_interrupt;
+				action.sa_flags = SA_RESTART;
+				if (::sigaction(SIGINT, &action, nullptr) < 0)
+					throw_system_error("sigaction");
+
+				show_position();
+				std::string line {};
+				while (std::cout << "(bedrock) " << std::flush, std::getline(std::cin, line)) {
+					std::istringstream words {line};
+					std::string command {};
+					words >> command;
+					if (command == "q" || command == "quit")
+						break;
+
+					interrupted = 0;
+					if (!do_command(command, words))
+						std::cout << "Unknown command; try \"help\".\n";
+				}
+			}
+
+		private:
+			struct controller_registers {
+				block_index block;
+				machine_word address;
+				machine_word transfer_count;
+				machine_word snapshot;
+				std::size_t undo_position;
+			};
+
+			struct saved_page {
+				std::size_t page;
+				std::vector<machine_word> words;
+			};
+
+			struct checkpoint {
+				std::uint64_t instructions;
+				machine_word instruction_pointer;
+				machine_word high_word;
+				std::array<machine_word, 1 << 4> registers;
+				dma_engine dma;
+				serial_dma_engine serial_dma;
+				machine_word halt;
+				std::vector<controller_registers> disks;
+				std::size_t input_position;
+				machine_word input_status;
+
+				// The pages written since the previous checkpoint, as they were at that checkpoint
+				std::vector<saved_page> pages;
+			};
+
+			// Bounds the memory held by undo data
+			static constexpr std::size_t max_checkpoints {1024};
+
+			machine_state& state;
+			std::uint64_t interval;
+			std::deque<checkpoint> checkpoints;
+
+			// Memory as of the latest checkpoint
+			std::vector<machine_word> shadow;
+
+			std::vector<undo_disk*> disks;
+			std::vector<bool> breakpoints;
+
+			// The most instructions ever executed; serial output up to here has already been written
+			std::uint64_t furthest;
+
+			bool do_command(const std::string& command, std::istringstream& words)
+			{
+				std::string first {};
+				std::string second {};
+				words >> first >> second;
+				unsigned count {1};
+				unsigned address {};
+				if ((command == "s" || command == "step") && (first.empty() || parse_number(first, count))) {
+					advance(state.instructions + count, false);
+					show_position();
+				}
+				else if ((command == "c" || command == "continue") && first.empty()) {
+					const auto start = state.instructions;
+					const auto any = std::find(breakpoints.begin(), breakpoints.end(), true) != breakpoints.end();
+					advance(std::numeric_limits<std::uint64_t>::max(), any, [&] {
+						return state.instructions != start && breakpoints[state.instruction_pointer];
+					});
+
+					show_position();
+				}
+				else if ((command == "rs" || command == "reverse-step") && (first.empty() || parse_number(first, count))) {
+					go_to(state.instructions - std::min<std::uint64_t>(count, state.instructions));
+					show_position();
+				}
+				else if ((command == "rc" || command == "reverse-continue") && first.empty()) {
+					reverse_continue();
+					show_position();
+				}
+				else if ((command == "b" || command == "break") && parse_address(first, address)) {
+					breakpoints[address] = true;
+				}
+				else if ((command == "d" || command == "delete") && parse_address(first, address)) {
+					breakpoints[address] = false;
+				}
+				else if ((command == "r" || command == "registers") && first.empty()) {
+					show_registers();
+				}
+				else if ((command == "x" || command == "memory") && parse_address(first, address)
+						 && (second.empty() || parse_number(second, count))) {
+					show_memory(static_cast<machine_word>(address), count);
+				}
+				else if (command == "help" || command == "h") {
+					std::cout << "step [<n>], continue, reverse-step [<n>], reverse-continue, break <address>,\n"
+								 "delete <address>, registers, memory <address> [<n>], quit\n";
+				}
+				else {
+					return command.empty();
+				}
+
+				return true;
+			}
+
+			static bool parse_address(std::string_view text, unsigned& address)
+			{
+				const auto end = text.data() + text.size();
+				const auto [last, error] = std::from_chars(text.data(), end, address, 16);
+				return !text.empty() && error == std::errc {} && last == end && address <= max_word;
+			}
+
+			// Runs forward to `target` or until `stop()`, taking checkpoints on the way; with `each`, stop() is asked
+			// before every instruction, and otherwise only at checkpoints
+			void advance(std::uint64_t target, bool each, const std::function<bool()>& stop = {})
+			{
+				state.silent_until = furthest;
+				while (!state.halt && state.instructions < target && !interrupted) {
+					if (state.instructions % interval == 0 && state.instructions > checkpoints.back().instructions)
+						take_checkpoint();
+
+					if (stop && stop())
+						break;
+
+					const auto next_checkpoint = (state.instructions / interval + 1) * interval;
+					try {
+						run(state, each ? state.instructions + 1 : std::min(target, next_checkpoint));
+					}
+					catch (const read_interrupted&) {
+						break;
+					}
+				}
+
+				furthest = std::max(furthest, state.instructions);
+				state.serial->flush();
+			}
+
+			void take_checkpoint()
+			{
+				// Issued transfers can't be restored, so they're finished here, at the same point in every rerun
+				for (auto& disk : state.disks)
+					complete_transfer(disk, state.memory);
+
+				checkpoint saved {};
+				saved.instructions = state.instructions;
+				saved.instruction_pointer = state.instruction_pointer;
+				saved.high_word = state.high_word;
+				saved.registers = state.registers;
+				saved.dma = state.dma;
+				saved.serial_dma = state.serial_dma;
+				saved.halt = state.halt;
+				for (std::size_t i {}; i < state.disks.size(); ++i) {
+					const auto& disk = state.disks[i];
+					const auto position = disks[i] ? disks[i]->position() : 0;
+					saved.disks.push_back({disk.block, disk.address, disk.transfer_count, disk.snapshot, position});
+				}
+
+				saved.input_position = state.inputs->position();
+				saved.input_status = state.inputs->last_status();
+				const auto& dirty = state.memory.dirty_pages();
+				for (std::size_t page {}; page < dirty.size(); ++page) {
+					if (!dirty[page])
+						continue;
+
+					const auto first = shadow.begin() + page * memory_adapter::page_words;
+					const auto length = memory_adapter::page_length(page);
+					saved.pages.push_back({page, {first, first + length}});
+					std::copy_n(state.memory.page_contents(page), length, first);
+				}
+
+				state.memory.clean();
+				checkpoints.push_back(std::move(saved));
+				if (checkpoints.size() > max_checkpoints) {
+					checkpoints.pop_front();
+					for (std::size_t i {}; i < disks.size(); ++i) {
+						if (disks[i])
+							disks[i]->forget(checkpoints.front().disks[i].undo_position);
+					}
+				}
+			}
+
+			// Makes checkpoint `index` the latest, and the machine as it was then
+			void restore(std::size_t index)
+			{
+				for (auto& disk : state.disks)
+					complete_transfer(disk, state.memory);
+
+				const auto& dirty = state.memory.dirty_pages();
+				for (std::size_t page {}; page < dirty.size(); ++page) {
+					if (dirty[page])
+						state.memory.restore_page(page, shadow.data() + page * memory_adapter::page_words);
+				}
+
+				for (auto i = checkpoints.size() - 1; i > index; --i) {
+					for (const auto& [page, words] : checkpoints[i].pages) {
+						state.memory.restore_page(page, words.data());
+						std::copy(words.begin(), words.end(), shadow.begin() + page * memory_adapter::page_words);
+					}
+				}
+
+				state.memory.clean();
+				checkpoints.resize(index + 1);
+				const auto& saved = checkpoints.back();
+				for (std::size_t i {}; i < state.disks.size(); ++i) {
+					auto& disk = state.disks[i];
+					const auto& registers = saved.disks[i];
+					if (disks[i])
+						disks[i]->rewind(registers.undo_position);
+
+					disk.block = registers.block;
+					disk.address = registers.address;
+					disk.transfer_count = registers.transfer_count;
+					disk.snapshot = registers.snapshot;
+				}
+
+				state.inputs->rewind(saved.input_position, saved.input_status);
+				state.instructions = saved.instructions;
+				state.instruction_pointer = saved.instruction_pointer;
+				state.high_word = saved.high_word;
+				state.registers = saved.registers;
+				state.dma = saved.dma;
+				state.serial_dma = saved.serial_dma;
+				state.halt = saved.halt;
+			}
+
+			// The latest checkpoint at or before `instructions`, or else the oldest
+			std::size_t checkpoint_before(std::uint64_t instructions) const
+			{
+				auto index = checkpoints.size() - 1;
+				while (index && checkpoints[index].instructions > instructions)
+					--index;
+
+				return index;
+			}
+
+			void go_to(std::uint64_t instructions)
+			{
+				restore(checkpoint_before(instructions));
+				advance(instructions, false);
+			}
+
+			// Looks for the latest breakpoint hit before now, one checkpoint interval at a time, going back no further
+			// than the oldest checkpoint
+			void reverse_continue()
+			{
+				auto end = state.instructions;
+				while (end > checkpoints.front().instructions && !interrupted) {
+					const auto index = checkpoint_before(end - 1);
+					const auto start = checkpoints[index].instructions;
+					std::optional<std::uint64_t> found {};
+					restore(index);
+					advance(end, true, [&] {
+						if (breakpoints[state.instruction_pointer])
+							found = state.instructions;
+
+						return false;
+					});
+
+					if (found) {
+						go_to(*found);
+						return;
+					}
+
+					end = start;
+				}
+
+				go_to(end);
+				std::cout << "Reached the oldest checkpoint.\n";
+			}
+
+			void show_position()
+			{
+				if (interrupted)
+					std::cout << "Interrupted.\n";
+
+				if (state.halt)
+					std::cout << "Halted with " << hex_word(state.halt) << ".\n";
+
+				std::cout << hex_word(state.instruction_pointer) << ": "
+						  << hex_word(state.memory.read(state.instruction_pointer)) << " (after " << state.instructions
+						  << " instructions)\n";
+			}
+
+			void show_registers()
+			{
+				for (std::size_t i {}; i < state.registers.size(); ++i)
+					std::cout << "r" << i << (i < 10 ? "  = " : " = ") << hex_word(state.registers[i])
+							  << (i % 4 == 3 ? "\n" : "  ");
+
+				std::cout << "ip  = " << hex_word(state.instruction_pointer) << "  high = " << hex_word(state.high_word)
+						  << "\n";
+			}
+
+			void show_memory(machine_word address, unsigned count)
+			{
+				for (unsigned i {}; i < count; ++i) {
+					const machine_word at = address + i;
+					if (i % 8 == 0)
+						std::cout << (i ? "\n" : "") << hex_word(at) << ":";
+
+					std::cout << " " << hex_word(state.memory.read(at));
+				}
+
+				std::cout << "\n";
+			}
+
+			static std::string hex_word(machine_word word)
+			{
+				std::ostringstream text {};
+				text << "0x" << std::hex << std::setw(4) << std::setfill('0') << word;
+				return text.str();
+			}
+		};
+
+		// Serves one client of the block protocol until it hangs up
+		void serve_connection(int connection, const std::vector<std::string>& images)
+		{
+			block_request_header request {};
+			if (!receive_fully(connection, &request, sizeof(request)) || request.operation != block_request::open
+				|| request.count > PATH_MAX)
+				return;
+
+			std::string name(request.count, '\0');
+			receive_fully(connection, name.data(), name.size());
+			const auto found = std::find_if(images.begin(), images.end(), [&name](const auto& image) {
+				return std::filesystem::path {image}.filename() == name;
+			});
+
+			block_reply_header reply {request.tag, 0, 0, 0};
+			unique_fd image {};
+			std::uint64_t size {};
+			if (found == images.end()) {
+				reply.error = ENOENT;
+			}
+			else if (image.reset(::open(found->c_str(), O_RDWR | O_CLOEXEC)); !image) {
+				reply.error = errno;
+			}
+			else {
+				size = file_size(image.get()) / block_size;
+				reply.size = static_cast<std::uint32_t>(std::min<std::uint64_t>(size, UINT32_MAX));
+			}
+
+			send_fully(connection, &reply, sizeof(reply));
+			if (reply.error)
+				return;
+
+			std::vector<std::uint8_t> data {};
+			while (receive_fully(connection, &request, sizeof(request))) {
+				if (request.count > max_block_request)
+					return;
+
+				reply = {request.tag, 0, 0, 0};
+				data.resize(request.operation == block_request::sync ? 0 : request.count * std::size_t {block_size});
+				if (request.operation == block_request::write)
+					receive_fully(connection, data.data(), data.size());
+
+				try {
+					const auto offset = off_t {block_size} * request.first;
+					if (std::uint64_t {request.first} + request.count > size)
+						throw std::system_error {EINVAL, std::generic_category()};
+
+					switch (request.operation) {
+					case block_request::read:
+						read_fully(image.get(), data.data(), data.size(), offset);
+						reply.count = request.count;
+						break;
+
+					case block_request::write:
+						write_fully(image.get(), data.data(), data.size(), offset);
+						break;
+
+					case block_request::sync:
+						if (::fsync(image.get()) < 0)
+							throw_system_error("fsync");
+
+						break;
+
+					default:
+						throw std::system_error {EINVAL, std::generic_category()};
+					}
+				}
+				catch (const std::system_error& error) {
+					reply.error = error.code().value();
+					reply.count = 0;
+				}
+
+				send_fully(connection, &reply, sizeof(reply));
+				if (reply.count)
+					send_fully(connection, data.data(), data.size());
+			}
+		}
+
+		// Serves the images, by file name, to any number of emulators at once
+		void serve_disks(const char* socket_path, const std::vector<const char*>& paths)
+		{
+			const std::vector<std::string> images(paths.begin(), paths.end());
+			const auto listener = listen_unix(socket_path);
+			while (true) {
+				unique_fd connection {::accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC)};
+				if (!connection && errno != EINTR && errno != ECONNABORTED)
+					throw_system_error("accept");
+				else if (!connection)
+					continue;
+
+				std::thread {[connection = std::move(connection), &images] {
+					try {
+						serve_connection(connection.get(), images);
+					}
+					catch (std::exception& error) {
+						std::cerr << "Dropped disk client: \"" << error.what() << "\"\n";
+					}
+				}}.detach();
+			}
+		}
+
+		struct machine_options {
+			std::vector<const char*> disk_paths;
+			disk_options disks;
+			serial_options serial;
+			bool batch {};
+			const char* telemetry_path {};
+			const char* serve_path {};
+			const char* save_path {};
+			const char* restore_path {};
+			const char* boot_cache_path {};
+			const char* fork_server_path {};
+			const char* submit_path {};
+			const char* record_path {};
+			const char* replay_path {};
+			unsigned debug_interval {};
+			const char* migrate_to_path {};
+			const char* migrate_from_path {};
+		};
+
+		void print_usage()
+		{
+			std::cout << "Usage: bedrock [options] <disk0> [<disk1>...]\n";
+			std::cout << "       bedrock --serve=<socket> <image>...\n";
+			std::cout << "       bedrock --submit=<socket>\n";
+			std::cout << "Use -- to omit a disk file, or unix:<socket>:<image> for an image served with --serve.\n\n";
+			std::cout << "Options:\n";
+			std::cout << "  --journal                Journal disk writes to <disk>.journal for crash consistency\n";
+			std::cout << "  --journal-batch=<n>      Commit the journal every <n> sector writes (default 64)\n";
+			std::cout << "  --journal-interval=<ms>  Commit the journal at most <ms> after a write (default 100)\n";
+			std::cout << "  --ramdisk[=<policy>]     Hold disks in memory, writing back never, at halt (default), or\n";
+			std::cout << "                           every <ms> milliseconds\n";
+			std::cout << "  --coalesce[=<n>]         Queue up to <n> sector writes (default 256) and merge adjacent ones\n";
+			std::cout << "  --direct[=<n>]           Bypass the host page cache, caching <n> sectors (default 1024) instead\n";
+			std::cout << "  --overlay                Keep disk writes in <disk>.overlay, leaving the image untouched\n";
+			std::cout << "  --serial=<device>        Connect serial I/O to consoles on the socket unix:<path>, or to a pty\n";
+			std::cout << "  --serial-flush=<policy>  Flush serial output at every newline (default), only when full, or\n";
+			std::cout << "                           every <ms> milliseconds\n";
+			std::cout << "  --serial-log=<path>      Also append all serial output to <path>, through a shared mapping\n";
+			std::cout << "  --batch                  Run headless, exiting with the low byte of the halt value as status\n";
+			std::cout << "  --input=<path>           With --batch, serial input (- for stdin), read in full up front\n";
+			std::cout << "  --output=<path>          With --batch, where serial output goes (- for stdout); else discarded\n";
+			std::cout << "  --telemetry=<path>       Write I/O telemetry as JSON to <path> (- for stderr) at halt\n";
+			std::cout << "  --serve=<socket>         Serve the images to other emulators on a Unix socket, until killed\n";
+			std::cout << "  --save-state=<path>      Save the machine to <path> whenever the emulator gets SIGUSR1\n";
+			std::cout << "  --restore=<path>         Resume the machine saved in <path> instead of booting\n";
+			std::cout << "  --boot-cache=<dir>       Save the machine in <dir> once booted, and resume from there next time\n";
+			std::cout << "  --fork-server=<socket>   Once booted, fork the machine for every job submitted on a Unix socket\n";
+			std::cout << "  --submit=<socket>        Run a job on a fork server, with this process's serial I/O and status\n";
+			std::cout << "  --record=<path>          Log serial input to <path>, by instruction count, for --replay\n";
+			std::cout << "  --replay=<path>          Rerun a recorded machine exactly, with serial input from its log\n";
+			std::cout << "  --debug[=<n>]            Debug on stdin, able to step backwards; checkpoint every <n>\n";
+			std::cout << "                           instructions (default 1000000)\n";
+			std::cout << "  --migrate-to=<socket>    Move the machine to the emulator listening on <socket> on SIGUSR2\n";
+			std::cout << "  --migrate-from=<socket>  Wait on <socket> for a machine to move here, and resume it\n";
+		}
+
+		std::optional<machine_options> parse_options(int argc, char** argv)
+		{
+			machine_options options {};
+			for (auto i = 1; i < argc; ++i) {
+				const std::string_view argument {argv[i]};
+				if (argument.size() <= 2 || argument.substr(0, 2) != "--") {
+					options.disk_paths.push_back(argv[i]);
+					continue;
+				}
+
+				const auto separator = argument.find('=');
+				const auto name = argument.substr(2, separator - 2);
+				const auto value = separator == argument.npos ? std::string_view {} : argument.substr(separator + 1);
+				unsigned number {};
+				if (name == "journal" && separator == argument.npos) {
+					options.disks.journal.enabled = true;
+				}
+				else if (name == "journal-batch" && parse_number(value, number) && number) {
+					options.disks.journal.batch_size = number;
+				}
+				else if (name == "journal-interval" && parse_number(value, number)) {
+					options.disks.journal.interval = std::chrono::milliseconds {number};
+				}
+				else if (name == "ramdisk" && (separator == argument.npos || value == "halt")) {
+					options.disks.ramdisk = {true, write_back_policy::at_halt, {}};
+				}
+				else if (name == "ramdisk" && value == "never") {
+					options.disks.ramdisk = {true, write_back_policy::never, {}};
+				}
+				else if (name == "ramdisk" && parse_number(value, number) && number) {
+					options.disks.ramdisk = {true, write_back_policy::periodic, std::chrono::milliseconds {number}};
+				}
+				else if (name == "coalesce" && separator == argument.npos) {
+					options.disks.coalesce_limit = 256;
+				}
+				else if (name == "coalesce" && parse_number(value, number) && number) {
+					options.disks.coalesce_limit = number;
+				}
+				else if (name == "direct" && separator == argument.npos) {
+					options.disks.direct_cache_blocks = 1024;
+				}
+				else if (name == "direct" && parse_number(value, number)) {
+					options.disks.direct_cache_blocks = number;
+				}
+				else if (name == "overlay" && separator == argument.npos) {
+					options.disks.overlay = true;
+				}
+				else if (name == "serial-flush" && value == "line") {
+					options.serial.flush = serial_flush_policy::line;
+				}
+				else if (name == "serial-flush" && value == "full") {
+					options.serial.flush = serial_flush_policy::full;
+				}
+				else if (name == "serial-flush" && parse_number(value, number) && number) {
+					options.serial.flush = serial_flush_policy::periodic;
+					options.serial.interval = std::chrono::milliseconds {number};
+				}
+				else if (name == "serial" && value == "pty") {
+					options.serial.transport = serial_transport::pty;
+				}
+				else if (name == "serial" && value.substr(0, remote_prefix.size()) == remote_prefix
+						 && value.size() > remote_prefix.size()) {
+					options.serial.transport = serial_transport::unix_socket;
+					options.serial.socket_path = value.substr(remote_prefix.size());
+				}
+				else if (name == "batch" && separator == argument.npos) {
+					options.batch = true;
+				}
+				else if (name == "input" && !value.empty()) {
+					options.serial.input_path = value;
+				}
+				else if (name == "output" && !value.empty()) {
+					options.serial.output_path = value;
+				}
+				else if (name == "serial-log" && !value.empty()) {
+					options.serial.log_path = value;
+				}
+				else if (name == "serve" && !value.empty()) {
+					options.serve_path = argv[i] + separator + 1;
+				}
+				else if (name == "telemetry" && !value.empty()) {
+					options.telemetry_path = argv[i] + separator + 1;
+				}
+				else if (name == "save-state" && !value.empty()) {
+					options.save_path = argv[i] + separator + 1;
+				}
+				else if (name == "restore" && !value.empty()) {
+					options.restore_path = argv[i] + separator + 1;
+				}
+				else if (name == "boot-cache" && !value.empty()) {
+					options.boot_cache_path = argv[i] + separator + 1;
+				}
+				else if (name == "fork-server" && !value.empty()) {
+					options.fork_server_path = argv[i] + separator + 1;
+				}
+				else if (name == "submit" && !value.empty()) {
+					options.submit_path = argv[i] + separator + 1;
+				}
+				else if (name == "record" && !value.empty()) {
+					options.record_path = argv[i] + separator + 1;
+				}
+				else if (name == "replay" && !value.empty()) {
+					options.replay_path = argv[i] + separator + 1;
+				}
+				else if (name == "debug" && separator == argument.npos) {
+					options.debug_interval = 1000000;
+				}
+				else if (name == "debug" && parse_number(value, number) && number) {
+					options.debug_interval = number;
+				}
+				else if (name == "migrate-to" && !value.empty()) {
+					options.migrate_to_path = argv[i] + separator + 1;
+				}
+				else if (name == "migrate-from" && !value.empty()) {
+					options.migrate_from_path = argv[i] + separator + 1;
+				}
+				else {
+					std::cerr << "Invalid option \"" << argument << "\".\n";
+					return {};
+				}
+			}
+
+			if (options.disks.journal.enabled && (options.disks.ramdisk.enabled || options.disks.overlay)) {
+				std::cerr << "--journal cannot be combined with --ramdisk or --overlay.\n";
+				return {};
+			}
+
+			if (options.disks.direct_cache_blocks && (options.disks.ramdisk.enabled || options.disks.coalesce_limit)) {
+				std::cerr << "--direct cannot be combined with --ramdisk or --coalesce.\n";
+				return {};
+			}
+
+			if (options.restore_path && options.boot_cache_path) {
+				std::cerr << "--restore cannot be combined with --boot-cache.\n";
+				return {};
+			}
+
+			// Recordings start from the firmware
+			if ((options.record_path || options.replay_path)
+				&& (options.restore_path || options.boot_cache_path || options.fork_server_path)) {
+				std::cerr << "--record and --replay cannot be combined with --restore, --boot-cache, or --fork-server.\n";
+				return {};
+			}
+
+			if (options.record_path && options.replay_path) {
+				std::cerr << "--record cannot be combined with --replay.\n";
+				return {};
+			}
+
+			// Jobs would share the connection to the disk server
+			const auto remote = [](std::string_view path) { return path.substr(0, remote_prefix.size()) == remote_prefix; };
+			if (options.fork_server_path && std::any_of(options.disk_paths.begin(), options.disk_paths.end(), remote)) {
+				std::cerr << "--fork-server cannot be used with remote disks.\n";
+				return {};
+			}
+
+			if (options.batch && options.serial.transport != serial_transport::stdio) {
+				std::cerr << "--batch cannot be combined with --serial.\n";
+				return {};
+			}
+
+			if (!options.batch && !(options.serial.input_path.empty() && options.serial.output_path.empty())) {
+				std::cerr << "--input and --output require --batch.\n";
+				return {};
+			}
+
+			// Batch output goes out in as few writes as possible
+			if (options.batch) {
+				options.serial.transport = serial_transport::batch;
+				options.serial.flush = serial_flush_policy::full;
+			}
+
+			// Migration takes the machine's state as the only history it has
+			const auto migrating = options.migrate_to_path || options.migrate_from_path;
+			if (migrating
+				&& (options.record_path || options.replay_path || options.debug_interval || options.fork_server_path)) {
+				std::cerr << "Migration cannot be combined with --record, --replay, --debug, or --fork-server.\n";
+				return {};
+			}
+
+			if (options.migrate_from_path && (options.restore_path || options.boot_cache_path)) {
+				std::cerr << "--migrate-from cannot be combined with --restore or --boot-cache.\n";
+				return {};
+			}
+
+			if (options.debug_interval && (options.record_path || options.fork_server_path)) {
+				std::cerr << "--debug cannot be combined with --record or --fork-server.\n";
+				return {};
+			}
+
+			if (options.debug_interval
+				&& (options.serial.transport == serial_transport::stdio || options.serial.input_path == "-")) {
+				std::cerr << "--debug takes commands from stdin, so serial input must come from elsewhere.\n";
+				return {};
+			}
+
+			return options;
+		}
+	}
+}
+
+using namespace bedrock;
+
+int main(int argc, char** argv)
+{
+	const auto options = parse_options(argc, argv);
+	if (!options)
+		return 1;
+
+	if (options->serve_path && !options->disk_paths.empty()) {
+		try {
+			serve_disks(options->serve_path, options->disk_paths);
+		}
+		catch (std::exception& error) {
+			std::cerr << "Encountered fatal error: \"" << error.what() << "\"\n";
+			return 1;
+		}
+	}
+
+	if (options->submit_path) {
+		try {
+			return submit_job(options->submit_path);
+		}
+		catch (std::exception& error) {
+			std::cerr << "Encountered fatal error: \"" << error.what() << "\"\n";
+			return 1;
+		}
+	}
+
+	if (options->disk_paths.empty() || options->disk_paths.size() > max_disks || options->serve_path) {
+		print_usage();
+		return 0;
+	}
+
+	const auto nullptr_if_none = [](auto path) { return std::strcmp(path, "--") == 0 ? nullptr : path; };
+	const auto check_path = [](auto path) {
+		if (!path || std::filesystem::exists(path) || std::string_view {path}.substr(0, remote_prefix.size()) == remote_prefix)
+			return true;
+
+		std::cerr << "File \"" << path << "\" does not exist.\n";
+
+		return false;
+	};
+
+	std::vector<const char*> paths {};
+	for (const auto path : options->disk_paths) {
+		paths.push_back(nullptr_if_none(path));
+		if (!check_path(paths.back()))
+			return 1;
+	}
+
+	try {
+		// The source closes the disks only at the very end
+		std::optional<incoming_machine> incoming {};
+		if (options->migrate_from_path)
+			incoming = receive_machine(options->migrate_from_path, describe_machine(paths));
+
+		auto telemetry = options->telemetry_path ? std::make_unique<io_telemetry>() : nullptr;
+		if (telemetry)
+			telemetry->disks.resize(paths.size());
+
+		std::vector<std::unique_ptr<disk_backend>> disks {};
+		for (std::size_t i {}; i < paths.size(); ++i)
+			disks.push_back(open_disk(paths[i], options->disks, telemetry ? &telemetry->disks[i] : nullptr));
+
+		machine_state state {std::move(disks), options->serial, std::move(telemetry)};
+		if (options->record_path || options->replay_path) {
+			const auto replaying = options->replay_path != nullptr;
+			const auto path = replaying ? options->replay_path : options->record_path;
+			state.inputs = std::make_unique<input_log>(path, replaying, fingerprint_disks(state));
+			for (auto& disk : state.disks)
+				disk.synchronous = true;
+		}
+
+		auto resumed = false;
+		if (incoming) {
+			take_over(state, *incoming);
+			resumed = true;
+		}
+
+		if (options->restore_path) {
+			restore_state(state, options->restore_path);
+			resumed = true;
+		}
+
+		if (options->boot_cache_path) {
+			auto entry = boot_cache_entry(state, options->boot_cache_path, options->disks.overlay);
+			if (std::filesystem::exists(entry) && boot_inputs_match(state, entry)) {
+				restore_state(state, entry);
+				resumed = true;
+			}
+			else {
+				std::filesystem::create_directories(options->boot_cache_path);
+				state.boot_cache_path = std::move(entry);
+				trace_boot(state);
+			}
+		}
+
+		if (options->save_path) {
+			state.save_path = options->save_path;
+			struct sigaction action {};
+			action.sa_handler = request_save;
+			action.sa_flags = SA_RESTART;
+			if (::sigaction(SIGUSR1, &action, nullptr) < 0)
+				throw_system_error("sigaction");
+		}
+
+		if (options->migrate_to_path) {
+			state.migrate_path = options->migrate_to_path;
+			state.disk_paths = paths;
+			state.disk_settings = options->disks;
+			struct sigaction action {};
+			action.sa_handler = request_migration;
+			action.sa_flags = SA_RESTART;
+			if (::sigaction(SIGUSR2, &action, nullptr) < 0)
+				throw_system_error("sigaction");
+		}
+
+		// A machine that was resumed has already booted
+		if (options->fork_server_path) {
+			state.fork_server_path = options->fork_server_path;
+			if (resumed)
+				serve_forks(state);
+		}
+
+		if (options->debug_interval)
+			debugger {state, options->debug_interval}.interact();
+		else
+			execute(state);
+
+		flush_devices(state);
+		if (state.telemetry) {
+			if (std::strcmp(options->telemetry_path, "-") == 0) {
+				write_telemetry(std::cerr, *state.telemetry);
+			}
+			else {
+				std::ofstream file {};
+				file.exceptions(file.badbit | file.failbit);
+				file.open(options->telemetry_path);
+				write_telemetry(file, *state.telemetry);
+			}
+		}
+
+		// The machine carries on elsewhere
+		if (state.migrated)
+			return 0;
+
+		if (options->batch || options->fork_server_path)
+			return state.halt & 0xff;
 	}
 	catch (std::exception& error) {
 		std::cerr << "Encountered fatal error: \"" << error.what() << "\"\n";